@@ -6,17 +6,29 @@ package Pristine::Tar;
 use warnings;
 use strict;
 use File::Temp;
+use File::Copy;
+use File::Basename;
+use File::Spec;
+use Fcntl qw(:flock O_RDWR O_CREAT);
+use POSIX qw(WNOHANG);
 use Getopt::Long;
 use IPC::Open2;
+use JSON::PP;
+use Time::HiRes;
 use Exporter q{import};
 
 our @EXPORT = qw(error message debug vprint doit try_doit doit_redir
-	tempdir dispatch comparefiles
-	$verbose $debug $keep);
+	tempdir scratchdir scratch_redir dispatch comparefiles firstdiff ncpus numjobs findcandidate
+	memorylimit memoryleft tracebegin traceend bestvariant trialthreads zgzverify
+	$verbose $debug $keep $jobs $memory $trace $stats);
 
 our $verbose=0;
 our $debug=0;
 our $keep=0;
+our $jobs=0;
+our $memory;
+our $trace;
+our $stats;
 
 sub progname {
 	my $name=$0;
@@ -48,30 +60,214 @@ sub doit {
 
 sub try_doit {
 	vprint(@_);
-	return system(@_)
+	my $t=tracecommand(@_);
+	my $ret=system(@_);
+	traceend($t, status => $? >> 8);
+	return $ret;
 }
 
 sub doit_redir {
 	no warnings 'once';
 	my ($in, $out, @args) = @_;
 	vprint(@args, "<", $in, ">", $out);
+	my $t=tracecommand(@args, "<", $in, ">", $out);
 	open INFILE, "<", $in or die("Could not open '$in' for reading: $!\n");
 	open OUTFILE, ">", $out or die("Could not open '$out' for reading: $!\n");
 	my $pid = open2(">&OUTFILE", "<&INFILE", @args);
 	waitpid $pid, 0;
+	traceend($t, status => $? >> 8);
 	if ($? != 0) {
 		error "command failed: @args";
 	}
 }
 
+# With --trace, events are appended to the file in the Trace Event
+# Format, which chrome://tracing, Perfetto and other trace viewers can
+# load. Every process of a run, including nested wrappers, writes to
+# the same file; each event is written with a single write, so they do
+# not get mixed up. Events are grouped by the program that was run, and
+# within that, by the process.
+my $tracefh;
+my $tracepid;
+my %tracing;
+
+sub traceinit {
+	my $command=shift;
+
+	return unless defined $trace;
+	# programs run from another directory, such as pristine-tar
+	# checkout's export, must still find the file
+	$trace=File::Spec->rel2abs($trace);
+	# the first program of a run starts the file; programs it runs
+	# add to it
+	if (! defined $ENV{PRISTINE_TAR_TRACE} ||
+	    $ENV{PRISTINE_TAR_TRACE} ne $trace) {
+		open(my $out, ">", $trace) || error "$trace: $!";
+		print $out "[\n";
+		close $out || error "$trace: $!";
+		$ENV{PRISTINE_TAR_TRACE}=$trace;
+	}
+	open($tracefh, ">>", $trace) || error "$trace: $!";
+	$tracepid=$$;
+	traceevent({ name => "process_name", ph => "M", pid => $$,
+		args => { name => progname()." $command" } });
+}
+
+sub traceevent {
+	my $event=shift;
+
+	return unless defined $tracefh;
+	syswrite($tracefh, JSON::PP->new->canonical->encode($event).",\n");
+}
+
+sub readio {
+	my %io;
+	if (open(my $in, "<", "/proc/self/io")) {
+		while (<$in>) {
+			$io{$1}=$2 if /^(\w+):\s+([0-9]+)/;
+		}
+		close $in;
+	}
+	return \%io;
+}
+
+# Starts a traced span, such as a phase of a command, and returns a
+# value to pass to traceend, or undef when not tracing. Optional
+# arguments are included in the event.
+sub tracebegin {
+	my ($name, %args) = @_;
+
+	return undef unless defined $tracefh;
+	my $t={ name => $name, cat => "phase", args => \%args,
+		start => Time::HiRes::time(), times => [times], io => readio(),
+		pid => $$ };
+	$tracing{$t}=$t;
+	return $t;
+}
+
+sub tracecommand {
+	return undef unless defined $tracefh;
+	my $t=tracebegin($_[0]=~m!([^/\s]+)(?:\s|$)! ? $1 : $_[0],
+		command => "@_");
+	$t->{cat}="command";
+	return $t;
+}
+
+# Ends a traced span. The event records its wall clock time, the CPU
+# time used by this process and the processes it waited for, and the
+# bytes they read and wrote, along with any further arguments.
+sub traceend {
+	my ($t, %args) = @_;
+
+	return unless defined $t;
+	delete $tracing{$t};
+	my @times=times;
+	my $io=readio();
+	my $cpu=0;
+	$cpu+=$times[$_] - $t->{times}->[$_] foreach 0..3;
+	traceevent({ name => $t->{name}, cat => $t->{cat}, ph => "X",
+		ts => int($t->{start} * 1000000),
+		dur => int((Time::HiRes::time() - $t->{start}) * 1000000),
+		pid => $tracepid, tid => $$,
+		args => { %{$t->{args}}, %args,
+			cpu => sprintf("%.2f", $cpu),
+			read => ($io->{rchar} || 0) - ($t->{io}->{rchar} || 0),
+			written => ($io->{wchar} || 0) - ($t->{io}->{wchar} || 0),
+		},
+	});
+}
+
 sub tempdir {
 	return File::Temp::tempdir("pristine-tar.XXXXXXXXXX",
 		TMPDIR => 1, CLEANUP => !$keep);
 }
 
+# Intermediate files, such as uncompressed tarballs, are kept in memory
+# here while there is room, rather than in TMPDIR.
+my $scratch="/dev/shm";
+my $scratchused=0;
+
+# Returns how many bytes more of intermediate files can be kept in
+# memory. That is up to half of the memorylimit(), as long as the
+# memory filesystem has the room; the rest is left for memoryleft().
+sub scratchbudget {
+	return 0 unless -d $scratch && -w $scratch;
+	my $limit=memorylimit();
+	return 0 unless defined $limit;
+	my $budget=$limit * 1024 * 1024 / 2 - $scratchused;
+	my @df=split(' ', (`df -Pk $scratch 2>/dev/null`)[1] || "");
+	return 0 unless @df >= 4 && $df[3]=~/^[0-9]+$/;
+	my $free=$df[3] * 1024;
+	return int($free < $budget ? $free : $budget);
+}
+
+# Returns a temporary directory for intermediate files of the given
+# size, which is in memory if that fits in the budget, and is counted
+# against it. Files written by scratch_redir are counted as they are
+# written, so a directory only for those is asked for with a size of 0.
+# Without a size, nothing can be counted, so the directory is in TMPDIR.
+sub scratchdir {
+	my $size=shift;
+
+	return tempdir() unless defined $size;
+	my $budget=scratchbudget();
+	if ($budget > 0 && $size <= $budget) {
+		$scratchused+=$size;
+		return File::Temp::tempdir("pristine-tar.XXXXXXXXXX",
+			DIR => $scratch, CLEANUP => !$keep);
+	}
+	return tempdir();
+}
+
+# Like doit_redir, but if the output is in memory and grows past the
+# budget, what has been written so far is moved to TMPDIR, the rest
+# goes there too, and a symlink is left in its place.
+sub scratch_redir {
+	my ($in, $out, @args) = @_;
+	vprint(@args, "<", $in, ">", $out);
+	my $t=tracecommand(@args, "<", $in, ">", $out);
+	my $pid=open(my $p, "-|");
+	die "fork: $!" unless defined $pid;
+	if (! $pid) {
+		open(STDIN, "<", $in) || die "$in: $!";
+		exec(@args) || die "exec $args[0]: $!";
+	}
+	binmode $p;
+	open(my $fh, ">", $out) || die "$out: $!";
+	binmode $fh;
+
+	my $inmemory=index($out, "$scratch/") == 0;
+	my $budget=$inmemory ? scratchbudget() : 0;
+	my $written=0;
+	for (;;) {
+		my $buf=readblock($p, 1024*1024);
+		last unless length $buf;
+		if ($inmemory && $written + length($buf) > $budget) {
+			close $fh || die "$out: $!";
+			my $disk=tempdir()."/".basename($out);
+			debug("$out is too large to keep in memory; moving it to $disk");
+			move($out, $disk) || die "move $out: $!";
+			symlink($disk, $out) || die "symlink $out: $!";
+			open($fh, ">>", $disk) || die "$disk: $!";
+			binmode $fh;
+			$inmemory=0;
+		}
+		print $fh $buf or die "$out: $!";
+		$written+=length $buf;
+	}
+	close $fh || die "$out: $!";
+	close $p || error "command failed: @args";
+	traceend($t, inmemory => $inmemory ? 1 : 0);
+	$scratchused+=$written if $inmemory;
+}
+
 # Workaround for bug #479317 in perl 5.10.
 sub END {
 	chdir("/");
+	# spans that exit or error skipped past
+	foreach my $t (values %tracing) {
+		traceend($t, exited => 1) if $t->{pid} == $$;
+	}
 }
 
 sub dispatch {
@@ -85,7 +281,11 @@ sub dispatch {
 	if (! GetOptions(%options,
 			"v|verbose!" => \$verbose,
 			"d|debug!" => \$debug,
-			"k|keep!" => \$keep) ||
+			"k|keep!" => \$keep,
+			"j|jobs=i" => \$jobs,
+			"memory=s" => \$memory,
+			"trace=s" => \$trace,
+			"stats=s" => \$stats) ||
 	    ! @ARGV) {
 	    	$command="usage";
 	}
@@ -104,18 +304,458 @@ sub dispatch {
 		$i=$commands{$command};
 	}
 
+	traceinit($command);
+	# before anything is kept in memory
+	memorylimit();
+	my $t=tracebegin($command, args => "@ARGV");
 	$i->[0]->(@ARGV);
+	traceend($t);
 }
 
+sub ncpus {
+	my $n=0;
+	if (open(my $in, "<", "/proc/cpuinfo")) {
+		$n=grep { /^processor\s*:/ } <$in>;
+		close $in;
+	}
+	return $n > 0 ? $n : 1;
+}
+
+# Fills the buffer with up to len bytes from the filehandle, stopping
+# short only at the end of the file.
+sub readblock {
+	my ($fh, $len) = @_;
+
+	my $buf="";
+	while (length($buf) < $len) {
+		my $n=sysread($fh, $buf, $len - length($buf), length($buf));
+		die "read: $!" unless defined $n;
+		last if $n == 0;
+	}
+	return $buf;
+}
+
+# Returns the offset of the first byte where two files differ, or undef
+# if they are identical. Optionally, each file can be compared starting
+# from an offset into it; the returned offset is relative to that.
+sub firstdiff {
+	my ($old, $new, $oskip, $nskip) = @_;
+
+	open(my $oin, "<", $old) || die "$old: $!";
+	open(my $nin, "<", $new) || die "$new: $!";
+	binmode $oin;
+	binmode $nin;
+	sysseek($oin, $oskip, 0) || die "seek: $!" if $oskip;
+	sysseek($nin, $nskip, 0) || die "seek: $!" if $nskip;
+
+	my $offset=0;
+	my $diff;
+	for (;;) {
+		my $obuf=readblock($oin, 1024*1024);
+		my $nbuf=readblock($nin, 1024*1024);
+		if ($obuf ne $nbuf) {
+			my $len=length($obuf) < length($nbuf) ? length($obuf) : length($nbuf);
+			# the xor of the common part is 0 up to the first difference
+			my $xor=substr($obuf, 0, $len) ^ substr($nbuf, 0, $len);
+			$diff=$offset + ($xor=~/[^\0]/ ? $-[0] : $len);
+			last;
+		}
+		last if ! length $obuf;
+		$offset+=length $obuf;
+	}
+	close $oin;
+	close $nin;
+	return $diff;
+}
+
+# How many processes to run at once; by default, one per CPU.
+sub numjobs {
+	return $jobs > 0 ? $jobs : ncpus();
+}
+
+# How many threads a compressor run as one of numjobs() tests should
+# use, so that between them they use about one per CPU.
+sub trialthreads {
+	my $n=int(ncpus() / numjobs());
+	return $n > 0 ? $n : 1;
+}
+
+# Returns the memory, in MiB, that this program and the ones it runs
+# can use between them, or undef if there is no limit. This is the
+# --memory option, a size such as "512M" or "2G", or else the memory
+# available according to the kernel when it is first asked for, since
+# later on what this program itself uses is no longer available.
+my $memorylimit;
+sub memorylimit {
+	if (defined $memory) {
+		my %scale=("" => 1, K => 1/1024, M => 1, G => 1024, T => 1024*1024);
+		if ($memory !~ /^([0-9]+)([KMGT]?)(?:iB|B)?$/i) {
+			error "bad memory limit \"$memory\"";
+		}
+		return int($1 * $scale{uc $2}) || 1;
+	}
+	return $memorylimit if defined $memorylimit;
+	if (open(my $in, "<", "/proc/meminfo")) {
+		while (<$in>) {
+			if (/^MemAvailable:\s+([0-9]+) kB/) {
+				close $in;
+				return $memorylimit=int($1 / 1024);
+			}
+		}
+		close $in;
+	}
+	return undef;
+}
+
+# Returns how much of the memorylimit(), in MiB, is not taken up by
+# intermediate files kept in memory, or undef if there is no limit.
+# This is what tests run at once can use between them, and what is
+# passed on as the --memory of the programs this one runs.
+sub memoryleft {
+	my $limit=memorylimit();
+	return undef unless defined $limit;
+	my $left=$limit - int($scratchused / (1024 * 1024));
+	return $left > 0 ? $left : 1;
+}
+
+# With --stats, the file keeps count of which candidate passed for each
+# fingerprint of an input's header. Each line is the fingerprint, the
+# count and the candidate's key, separated by tabs.
+sub readstats {
+	my $fh=shift;
+
+	my %counts;
+	while (<$fh>) {
+		chomp;
+		my ($fingerprint, $count, $key)=split(/\t/, $_, 3);
+		next unless defined $key && $count=~/^[0-9]+$/;
+		$counts{$fingerprint}{$key}=$count;
+	}
+	return \%counts;
+}
+
+# Sorts candidates so the ones that have passed most often for the
+# fingerprint come first; the rest keep their order.
+sub statsorder {
+	my ($fingerprint, $key, @candidates) = @_;
+
+	open(my $in, "<", $stats) || return @candidates;
+	flock($in, LOCK_SH) || die "flock $stats: $!";
+	my $counts=readstats($in)->{$fingerprint};
+	close $in;
+	return @candidates unless defined $counts;
+
+	my @hits=map { $counts->{$key->($_)} || 0 } @candidates;
+	my @order=sort { $hits[$b] <=> $hits[$a] || $a <=> $b } 0..$#candidates;
+	debug("candidate order from $stats: ".join(" ", map { $_ + 1 } @order))
+		if grep { $order[$_] != $_ } 0..$#order;
+	return @candidates[@order];
+}
+
+sub statsrecord {
+	my ($fingerprint, $key) = @_;
+
+	sysopen(my $fh, $stats, O_RDWR|O_CREAT) || die "$stats: $!";
+	flock($fh, LOCK_EX) || die "flock $stats: $!";
+	my $counts=readstats($fh);
+	$counts->{$fingerprint}{$key}++;
+	seek($fh, 0, 0) || die "seek $stats: $!";
+	truncate($fh, 0) || die "truncate $stats: $!";
+	foreach my $f (sort keys %$counts) {
+		foreach my $k (sort keys %{$counts->{$f}}) {
+			print $fh "$f\t$counts->{$f}{$k}\t$k\n";
+		}
+	}
+	close $fh || die "$stats: $!";
+}
+
+sub candidatename {
+	my $c=shift;
+
+	return ref $c eq 'ARRAY' ? "@$c" :
+		ref $c eq 'HASH' && ref $c->{variant} ? "@{$c->{variant}}" :
+		"$c";
+}
+
+# Tests candidates, running up to numjobs() tests at once, and returns
+# the first candidate that passes, or undef if none do.
+#
+# An optional hashref of options can come first. Its memory is a sub
+# that is passed a candidate and returns how many MiB its test will use.
+# Tests are then only started, in order, while they fit in the
+# memoryleft() together; one that does not fit on its own is run by
+# itself.
+#
+# Its fingerprint is a string describing the input's header, which
+# enables --stats for the search. The key option then is a sub that
+# returns a string naming a candidate the same way for every input with
+# that fingerprint; by default, it is the candidate's arguments.
+#
+# Each test runs in a child process, which is passed the candidate. It
+# passes if it returns true, or if it execs a command that exits 0. A
+# test that fails returns false, or its command exits 1; anything else
+# is an error.
+#
+# Once a candidate passes, no more tests are started, and the tests of
+# later candidates are cancelled. Tests of earlier candidates are left
+# to finish, so the candidate returned is always the first in the list
+# that passes, no matter how many tests run at once.
+sub findcandidate {
+	my %opts=ref $_[0] eq 'HASH' ? %{shift()} : ();
+	my $test=shift;
+	my @candidates=@_;
+
+	my $key=defined $opts{key} ? $opts{key} : \&candidatename;
+	my $usestats=defined $stats && defined $opts{fingerprint};
+	if ($usestats) {
+		# keys and fingerprints are stored on tab separated lines
+		$opts{fingerprint}=~s/\s/ /g;
+		my $k=$key;
+		$key=sub { my $s=$k->(@_); $s=~s/\s/ /g; $s };
+		@candidates=statsorder($opts{fingerprint}, $key, @candidates);
+	}
+
+	my $max=numjobs();
+	my $limit=defined $opts{memory} ? memoryleft() : undef;
+	my $used=0;
+	my ($found, %running);
+	my $next=0;
+	my $cancel=sub {
+		my $after=shift;
+		foreach my $pid (keys %running) {
+			next if $running{$pid}->{index} < $after;
+			# the test's own children are in its process group
+			kill(TERM => -$pid);
+			$running{$pid}->{killed}=1;
+		}
+	};
+	my $search=tracebegin("search", candidates => scalar @candidates);
+	my $tracecandidate=sub {
+		my ($pid, $t, $result) = @_;
+		return unless defined $search;
+		my $c=$candidates[$t->{index}];
+		traceevent({ name => "candidate ".($t->{index} + 1),
+			cat => "candidate", ph => "X",
+			ts => int($t->{start} * 1000000),
+			dur => int((Time::HiRes::time() - $t->{start}) * 1000000),
+			pid => $tracepid, tid => $pid,
+			args => { result => $result, candidate => candidatename($c) },
+		});
+	};
+	# being in their own process groups, tests would not see a ^C
+	local $SIG{INT}=local $SIG{TERM}=sub {
+		$cancel->(0);
+		error "interrupted";
+	};
+	while (%running || ($next < @candidates && ! defined $found)) {
+		while ($next < @candidates && ! defined $found &&
+		       keys %running < $max) {
+			my $need=defined $limit ? $opts{memory}->($candidates[$next]) : 0;
+			if (defined $limit && $used + $need > $limit) {
+				last if %running;
+				debug("candidate ".($next + 1)." needs $need MiB, more than the $limit MiB limit");
+			}
+			my $i=$next++;
+			my $pid=fork;
+			die "fork: $!" unless defined $pid;
+			if (! $pid) {
+				$SIG{INT}=$SIG{TERM}='DEFAULT';
+				setpgrp(0, 0);
+				my $ret=eval { $test->($candidates[$i]) };
+				if ($@) {
+					print STDERR $@;
+					exit 255;
+				}
+				exit($ret ? 0 : 1);
+			}
+			# also done here, in case it is cancelled at once
+			setpgrp($pid, $pid);
+			$running{$pid}={ index => $i, memory => $need,
+				start => Time::HiRes::time() };
+			$used+=$need;
+		}
+
+		my $pid=wait;
+		last if $pid < 0;
+		my $t=delete $running{$pid};
+		$used-=$t->{memory};
+		if ($? == 0) {
+			$tracecandidate->($pid, $t, "pass");
+			if (! defined $found || $t->{index} < $found) {
+				$found=$t->{index};
+				$cancel->($found);
+			}
+		}
+		elsif (($? & 127 || $? >> 8 != 1) && ! $t->{killed}) {
+			$tracecandidate->($pid, $t, "error");
+			$cancel->(0);
+			1 while wait > 0;
+			error "test of candidate ".($t->{index} + 1)." failed";
+		}
+		else {
+			$tracecandidate->($pid, $t,
+				$t->{killed} ? "cancelled" : "fail");
+		}
+	}
+	traceend($search, found => defined $found ? $found + 1 : 0);
+	return undef unless defined $found;
+	statsrecord($opts{fingerprint}, $key->($candidates[$found]))
+		if $usestats;
+	return $candidates[$found];
+}
+
+# Returns 0 if the files are identical, like cmp(1) does. Files of
+# different sizes are not read at all.
 sub comparefiles {
 	my ($old, $new) = (shift, shift);
-	system('cmp', '-s', $old, $new);
 
-	if ($? == -1 || $? & 127) {
-		die("Failed to execute cmp: $!\n");
+	my $osize=-s $old;
+	my $nsize=-s $new;
+	if (! defined $osize || ! defined $nsize) {
+		die("Failed to compare $old and $new: $!\n");
 	}
+	return 1 if $osize != $nsize;
+	return defined firstdiff($old, $new) ? 1 : 0;
+}
+
+# Runs zgz with the given parameters on the uncompressed input, having it
+# compare its output with the original as it goes, so a wrong variant is
+# abandoned as soon as it diverges. Returns undef if the output matches,
+# or the offset into the file where it first differs. zgz exits 1 on
+# errors too, so it only differs if it also printed the offset.
+sub zgzverify {
+	my ($orig, $tempin, @args) = @_;
+	my @cmd=('zgz', @args, '--verify', $orig);
+	vprint(@cmd, "<", $tempin);
+	my $pid=open(my $out, "-|");
+	die "fork: $!" unless defined $pid;
+	if (! $pid) {
+		open(STDIN, "<", $tempin) || die "$tempin: $!";
+		exec(@cmd) || die "exec zgz: $!";
+	}
+	my $offset=<$out>;
+	close $out;
+	return undef if $? == 0;
+	if ($? >> 8 == 1 && defined $offset) {
+		chomp $offset;
+		return $offset;
+	}
+	error "command failed: @cmd";
+}
+
+# When no candidate reproduces a file exactly, this finds the variant
+# whose xdelta to the original is smallest, moves that delta to the
+# bestdelta file, and returns the variant and the size of its delta.
+#
+# Each variant is a hashref with the candidate in variant, and its
+# output in file. If generate is set, the output is only made, by
+# running the command in it on the input file it starts with, when
+# the variant is scored. Optionally, diverge is the offset where the
+# output first differs from the original, and tail is how much of the
+# original follows that point; the variants that diverge last are tried
+# first, and ones whose tail dwarfs the best delta so far are skipped.
+# Up to numjobs() variants are scored at once, and one whose partial
+# xdelta has grown past the best delta is abandoned.
+sub bestvariant {
+	my ($orig, $bestdelta, @failed) = @_;
 
-	return $? >> 8;
+	my $t=tracebegin("bestvariant", variants => scalar @failed);
+	# The later a variant diverges from the original, the smaller
+	# its delta is likely to be, so try those first.
+	@failed=sort { ($b->{diverge} || 0) <=> ($a->{diverge} || 0) } @failed;
+
+	my $max=numjobs();
+	my ($best, $bestsize);
+	my %running;
+	while (@failed || %running) {
+		while (@failed && keys %running < $max) {
+			my $v=shift @failed;
+			# Past the point where they diverge, the compressed
+			# streams are not even aligned, so xdelta can reuse
+			# little of what follows. A variant whose divergent
+			# tail dwarfs the best delta so far is not going to
+			# win.
+			if (defined $bestsize && defined $v->{tail} &&
+			    $v->{tail} > 2 * $bestsize) {
+				debug("not scoring variant @{$v->{variant}}: diverges at $v->{diverge}");
+				unlink($v->{file});
+				next;
+			}
+			$v->{delta}="$v->{file}.delta";
+			my @cmd=("xdelta", "delta", "-0", "--pristine",
+				$v->{file}, $orig, $v->{delta});
+			vprint(@cmd);
+			my $pid=fork;
+			if (! defined $pid) {
+				die "fork: $!";
+			}
+			if (! $pid) {
+				# so an abandoned variant's generator is
+				# stopped too
+				setpgrp(0, 0);
+				if (defined $v->{generate}) {
+					my ($in, @gen)=@{$v->{generate}};
+					eval { doit_redir($in, $v->{file}, @gen) };
+					if ($@) {
+						print STDERR $@;
+						exit 254;
+					}
+				}
+				open(STDERR, ">", "/dev/null");
+				exec(@cmd) || exit 255;
+			}
+			setpgrp($pid, $pid);
+			$running{$pid}=$v;
+		}
+
+		my $pid=waitpid(-1, WNOHANG);
+		if ($pid > 0) {
+			my $v=delete $running{$pid};
+			if (! $v->{killed} && $? >> 8 == 254) {
+				kill(TERM => -$_) foreach keys %running;
+				1 while wait > 0;
+				error "failed to generate the output of variant @{$v->{variant}}";
+			}
+			# xdelta exits 1 on success
+			if (! $v->{killed} && $? >> 8 == 1) {
+				my $size=(stat($v->{delta}))[7];
+				debug("delta to variant @{$v->{variant}}: $size bytes");
+				if (! defined $bestsize || $size < $bestsize) {
+					unlink($best->{delta}) if defined $best;
+					$best=$v;
+					$bestsize=$size;
+					next;
+				}
+			}
+			unlink($v->{delta});
+		}
+		elsif ($pid < 0) {
+			last;
+		}
+		elsif (defined $bestsize) {
+			# Stop any xdelta whose partial output has already
+			# grown past the best delta.
+			foreach my $pid (keys %running) {
+				my $v=$running{$pid};
+				if (! $v->{killed} && (-s $v->{delta} || 0) > $bestsize) {
+					debug("abandoning variant @{$v->{variant}}");
+					kill(TERM => -$pid);
+					$v->{killed}=1;
+				}
+			}
+			Time::HiRes::sleep(0.1);
+		}
+		else {
+			Time::HiRes::sleep(0.1);
+		}
+	}
+
+	if (! defined $best) {
+		error "xdelta failed to generate a delta for $orig";
+	}
+	rename($best->{delta}, $bestdelta) || die "rename: $!";
+	traceend($t, size => $bestsize);
+	return ($best->{variant}, $bestsize);
 }
 
 1
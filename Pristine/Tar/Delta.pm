@@ -7,10 +7,13 @@ use Pristine::Tar;
 use warnings;
 use strict;
 
+# Formats deltas can be read in; the first one is used for new deltas.
+my @formats=qw(Index Tarball);
+
 # Checks if a field of a delta should be stored in the delta hash using
 # a filename. (Normally the hash stores the whole field value, but
 # using filenames makes sense for a few fields.)
-my %delta_files=map { $_ => 1 } qw(manifest delta wrapper);
+my %delta_files=map { $_ => 1 } qw(manifest checksums delta wrapper);
 sub is_filename {
 	my $field=shift;
 	return $delta_files{$field};
@@ -30,54 +33,84 @@ sub handler {
 
 # After the type of delta and the file to create (which can be "-"
 # to send it to stdout), this takes a hashref containing the contents of
-# the delta to write.
+# the delta to write. Options for the format can follow; the Index
+# format takes compression => "zlib", "xz" or "zstd".
+#
+# Formats write "-" straight to stdout, rather than going via a
+# temporary file.
 sub write {
 	my $type=shift;
 	my $deltafile=shift;
 	my $delta=shift;
+	my %opts=@_;
 
-	my $tempdir=tempdir();
-
-	my $stdout=0;
-	if ($deltafile eq "-") {
-		$stdout=1;
-		$deltafile="$tempdir/tmpout";
-	}
-	
-	handler('write', $type, $deltafile, $delta);
-
-	if ($stdout) {
-		doit("cat", $deltafile);
-		unlink($deltafile);
-	}
+	handler('write', $type, $deltafile, $delta, %opts);
 
 	return $delta;
 }
 
-# Returns a hashref of the contents of the delta.
+# How much of the start of a delta file is read to detect its format.
+my $sniffsize=8;
+
+# Returns a hashref of the contents of the delta. The format of the
+# file is detected, so deltas written in older formats can be read
+# too.
+#
+# The deltafile can be "-" to read stdin. Formats read the delta from
+# a filehandle, sequentially, so it is never copied to a temporary file
+# first.
 sub read {
 	my $type=shift;
 	my $deltafile=shift;
-	
-	my $tempdir=tempdir();
 
-	my $stdin=0;
+	my $in;
 	if ($deltafile eq "-") {
-		$deltafile="$tempdir/tmpin";
-		open (my $out, ">", $deltafile) || die "$deltafile: $!";
-		while (<STDIN>) {
-			print $out $_;
+		$in=\*STDIN;
+	}
+	else {
+		open($in, "<", $deltafile) || die "$deltafile: $!";
+	}
+	binmode $in;
+
+	my $head="";
+	readblocks($in, $sniffsize, sub { $head.=shift });
+
+	foreach my $format ($type, grep { $_ ne $type } @formats) {
+		if (handler('sniff', $format, $head)) {
+			$type=$format;
+			last;
 		}
-		close $out;
 	}
 
-	my $delta=handler('read', $type, $deltafile);
-	
-	unlink($deltafile) if $stdin;
+	my $delta=handler('read', $type, $in, $head);
+
+	close $in unless $deltafile eq "-";
 
 	return $delta;
 }
 
+# Reads len bytes from a filehandle in large blocks, passing each to a
+# sub. If len is undef, reads to the end of the file. Returns the
+# number of bytes read, which is less than len at the end of the file.
+sub readblocks {
+	my $in=shift;
+	my $len=shift;
+	my $sub=shift;
+
+	my $blocksize=1024*1024;
+	my $total=0;
+	while (! defined $len || $total < $len) {
+		my $want=$blocksize;
+		$want=$len - $total if defined $len && $len - $total < $want;
+		my $n=sysread($in, my $buf, $want);
+		die "read: $!" unless defined $n;
+		last if $n == 0;
+		$total+=$n;
+		$sub->($buf);
+	}
+	return $total;
+}
+
 # Checks the type, maxversion, minversion of a delta hashref.
 # Checks that the delta contains all specified fields.
 # Returns the hashref if it is ok.
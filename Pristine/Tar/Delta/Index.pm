@@ -0,0 +1,304 @@
+#!/usr/bin/perl
+# pristine-tar delta files formatted as an indexed container
+# See delta-format.txt for the layout.
+package Pristine::Tar::Delta::Index;
+
+use Pristine::Tar;
+use Pristine::Tar::Delta;
+use Compress::Zlib;
+use warnings;
+use strict;
+
+my $magic="\x89PTD\r\n\x1a\n";
+my $container_version=1;
+
+# how a field's data is encoded in the container
+my $ENC_RAW=0;
+my $ENC_ZLIB=1;
+my $ENC_XZ=2;
+my $ENC_ZSTD=3;
+
+# compression methods that can be selected for the container; the
+# header records which one was used
+my %methods=(zlib => $ENC_ZLIB, xz => $ENC_XZ, zstd => $ENC_ZSTD);
+
+# Fields stored as files, such as the xdelta, are large enough to be
+# worth running through an external compressor.
+my %compressors=(
+	$ENC_XZ => [qw(xz -9e -c -q)],
+	# long distance matching finds the repeats across a whole xdelta
+	$ENC_ZSTD => [qw(zstd -19 --long=27 -c -q)],
+);
+my %decompressors=(
+	$ENC_XZ => [qw(xz -dc -q)],
+	$ENC_ZSTD => [qw(zstd -dc -q --long=31)],
+);
+
+sub sniff {
+	my $class=shift;
+	my $head=shift;
+
+	return substr($head, 0, length $magic) eq $magic;
+}
+
+sub slurp {
+	my $file=shift;
+
+	open(my $in, "<", $file) || die "$file: $!";
+	binmode $in;
+	local $/=undef;
+	my $data=<$in>;
+	close $in;
+	return defined $data ? $data : "";
+}
+
+# Opens a filehandle that writes to the file, through a command.
+sub pipeto {
+	my ($file, @cmd) = @_;
+
+	vprint(@cmd, ">", $file);
+	my $pid=open(my $p, "|-");
+	die "fork: $!" unless defined $pid;
+	if (! $pid) {
+		open(STDOUT, ">", $file) || die "$file: $!";
+		exec(@cmd) || die "exec $cmd[0]: $!";
+	}
+	binmode $p;
+	return $p;
+}
+
+sub readfull {
+	my ($fh, $len) = @_;
+
+	my $buf="";
+	while (length($buf) < $len) {
+		my $n=sysread($fh, $buf, $len - length($buf), length($buf));
+		die "read: $!" unless defined $n;
+		error "truncated delta file" if $n == 0;
+	}
+	return $buf;
+}
+
+# Deflates a file into another, a block at a time.
+sub deflatefile {
+	my ($file, $zfile) = @_;
+
+	my ($z, $status)=deflateInit();
+	die "deflateInit failed" unless defined $z;
+	open(my $in, "<", $file) || die "$file: $!";
+	binmode $in;
+	open(my $out, ">", $zfile) || die "$zfile: $!";
+	binmode $out;
+	my $data;
+	Pristine::Tar::Delta::readblocks($in, undef, sub {
+		($data, $status)=$z->deflate(shift);
+		die "deflate failed" unless $status == Z_OK;
+		print $out $data or die "$zfile: $!";
+	});
+	($data, $status)=$z->flush();
+	die "deflate failed" unless $status == Z_OK;
+	print $out $data or die "$zfile: $!";
+	close $out || die "$zfile: $!";
+	close $in;
+}
+
+sub write {
+	my $class=shift;
+	my $deltafile=shift;
+	my $delta=shift;
+	my %opts=@_;
+
+	my $method=defined $opts{compression} ? $opts{compression} : "zlib";
+	if (! exists $methods{$method}) {
+		error "unsupported delta compression $method";
+	}
+	my $compressor=$compressors{$methods{$method}};
+
+	# sorted, so the same delta always makes the same file
+	my @fields=sort keys %$delta;
+	my $tempdir;
+	my @index;
+	foreach my $field (@fields) {
+		if (! Pristine::Tar::Delta::is_filename($field)) {
+			my $data=$delta->{$field};
+			my $enc=$ENC_RAW;
+			my $z=compress($data);
+			if (defined $z && length($z) < length($data)) {
+				$data=$z;
+				$enc=$ENC_ZLIB;
+			}
+			push @index, [$field, $enc, length($data), \$data];
+			next;
+		}
+
+		# File fields can be large, so they are encoded into temp
+		# files and copied to the output a block at a time. With an
+		# external compressor, zlib is not worth trying first.
+		my $file=$delta->{$field};
+		my $enc=$ENC_RAW;
+		my $len=-s $file;
+		die "$file: $!" unless defined $len;
+		$tempdir=tempdir() unless defined $tempdir;
+		my $encfile="$tempdir/$field";
+		if (defined $compressor) {
+			doit_redir($file, $encfile, @$compressor);
+		}
+		else {
+			deflatefile($file, $encfile);
+		}
+		if (-s $encfile < $len) {
+			$file=$encfile;
+			$len=-s $encfile;
+			$enc=defined $compressor ? $methods{$method} : $ENC_ZLIB;
+		}
+		push @index, [$field, $enc, $len, $file];
+	}
+
+	my $offset=length($magic) + 8;
+	$offset+=2 + length($_->[0]) + 1 + 16 foreach @index;
+	my $header=$magic.pack("n n N", $container_version, $methods{$method},
+		scalar @index);
+	foreach my $i (@index) {
+		my ($field, $enc, $len)=@$i;
+		$header.=pack("n/a* C Q> Q>", $field, $enc, $offset, $len);
+		$offset+=$len;
+	}
+
+	my $out;
+	if ($deltafile eq "-") {
+		$out=\*STDOUT;
+	}
+	else {
+		open($out, ">", $deltafile) || die "$deltafile: $!";
+	}
+	binmode $out;
+	print $out $header or die "$deltafile: $!";
+	foreach my $i (@index) {
+		my ($field, $enc, $len, $data)=@$i;
+		if (ref $data) {
+			print $out $$data or die "$deltafile: $!";
+			next;
+		}
+		open(my $in, "<", $data) || die "$data: $!";
+		binmode $in;
+		my $got=Pristine::Tar::Delta::readblocks($in, $len, sub {
+			print {$out} shift or die "$deltafile: $!";
+		});
+		die "$data: short read" if $got != $len;
+		close $in;
+	}
+	close $out || die "$deltafile: $!" unless $deltafile eq "-";
+
+	return $delta;
+}
+
+# Reads the container from a filehandle, whose first bytes, which were
+# already read to sniff it, are passed in. The fields are read in the order of their
+# offsets, so this works on a pipe.
+sub read {
+	my $class=shift;
+	my $in=shift;
+	my $head=shift;
+
+	# the head is no longer than the magic
+	$head.=readfull($in, length($magic) - length($head));
+	if ($head ne $magic) {
+		error "not an indexed delta file";
+	}
+	my $pos=length($magic);
+	my $take=sub {
+		my $len=shift;
+		$pos+=$len;
+		return readfull($in, $len);
+	};
+	my ($version, $compression, $count)=unpack("n n N", $take->(8));
+	if ($version > $container_version) {
+		error "delta container is version $version, newer than maximum supported version $container_version";
+	}
+	if (! grep { $_ == $compression } values %methods) {
+		error "delta container uses unsupported compression $compression";
+	}
+
+	my @index;
+	foreach (1..$count) {
+		my $field=$take->(unpack("n", $take->(2)));
+		if ($field !~ /^[A-Za-z0-9_]+$/) {
+			error "bad field name in delta file";
+		}
+		push @index, [$field, unpack("C Q> Q>", $take->(17))];
+	}
+
+	my $tempdir;
+	my %delta;
+	foreach my $i (sort { $a->[2] <=> $b->[2] } @index) {
+		my ($field, $enc, $offset, $len)=@$i;
+		if ($offset < $pos) {
+			error "overlapping fields in delta file";
+		}
+		if ($enc != $ENC_RAW && $enc != $ENC_ZLIB &&
+		    ! exists $decompressors{$enc}) {
+			error "unknown encoding $enc for $field in delta file";
+		}
+		my $skip=$offset - $pos;
+		if (Pristine::Tar::Delta::readblocks($in, $skip, sub {}) != $skip) {
+			error "truncated delta file";
+		}
+		$pos=$offset;
+
+		my $isfile=Pristine::Tar::Delta::is_filename($field);
+		if (! $isfile && ! exists $decompressors{$enc}) {
+			my $data=$take->($len);
+			if ($enc == $ENC_ZLIB) {
+				$data=uncompress($data);
+				error "corrupt $field in delta file" unless defined $data;
+			}
+			$delta{$field}=$data;
+			next;
+		}
+
+		# large fields go to a file a block at a time
+		$tempdir=tempdir() unless defined $tempdir;
+		my $file="$tempdir/$field";
+		my $out;
+		if (exists $decompressors{$enc}) {
+			$out=pipeto($file, @{$decompressors{$enc}});
+		}
+		else {
+			open($out, ">", $file) || die "$file: $!";
+			binmode $out;
+		}
+		my ($z, $status);
+		if ($enc == $ENC_ZLIB) {
+			($z, $status)=inflateInit();
+			die "inflateInit failed" unless defined $z;
+		}
+		my $got=Pristine::Tar::Delta::readblocks($in, $len, sub {
+			my $buf=shift;
+			if (defined $z) {
+				my $data;
+				($data, $status)=$z->inflate($buf);
+				if ($status != Z_OK && $status != Z_STREAM_END) {
+					error "corrupt $field in delta file";
+				}
+				$buf=$data;
+			}
+			print $out $buf or die "$file: $!";
+		});
+		error "truncated delta file" if $got != $len;
+		$pos+=$len;
+		if (defined $z && $status != Z_STREAM_END) {
+			error "corrupt $field in delta file";
+		}
+		if (exists $decompressors{$enc}) {
+			close $out || error "command failed: @{$decompressors{$enc}}";
+		}
+		else {
+			close $out || die "$file: $!";
+		}
+		$delta{$field}=$isfile ? $file : slurp($file);
+	}
+
+	return \%delta;
+}
+
+1
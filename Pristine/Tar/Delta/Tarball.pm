@@ -4,10 +4,19 @@ package Pristine::Tar::Delta::Tarball;
 
 use Pristine::Tar;
 use Pristine::Tar::Delta;
+use Pristine::Tar::Formats;
 use File::Basename;
 use warnings;
 use strict;
 
+sub sniff {
+	my $class=shift;
+	my $head=shift;
+
+	return length($head) >= 2 &&
+		substr($head, 0, 2) eq chr($fconstants{GZIP_ID1}).chr($fconstants{GZIP_ID2});
+}
+
 sub write {
 	my $class=shift;
 	my $deltafile=shift;
@@ -33,10 +42,21 @@ sub write {
 
 sub read {
 	my $class=shift;
-	my $deltafile=shift;
+	my $in=shift;
+	my $head=shift;
 	
 	my $tempdir=tempdir();
-	doit("tar", "xf", File::Spec->rel2abs($deltafile), "-C", $tempdir);
+	my @cmd=("tar", "xzf", "-", "-C", $tempdir);
+	vprint(@cmd);
+	my $pid=open(my $tar, "|-");
+	die "fork: $!" unless defined $pid;
+	if (! $pid) {
+		exec(@cmd) || die "exec tar: $!";
+	}
+	binmode $tar;
+	print $tar $head;
+	Pristine::Tar::Delta::readblocks($in, undef, sub { print $tar shift });
+	close $tar || error "command failed: @cmd";
 
 	my %delta;
 	foreach my $file (glob("$tempdir/*")) {
@@ -6,7 +6,7 @@ package Pristine::Tar::Formats;
 use warnings;
 use strict;
 use Exporter q{import};
-our @EXPORT=qw{is_gz is_bz2 is_xz %fconstants};
+our @EXPORT=qw{is_gz is_bz2 is_xz is_zst %fconstants};
 
 our %fconstants=(
 	# magic identification
@@ -20,6 +20,10 @@ our %fconstants=(
 	XZ_ID4 => 0x58,
 	XZ_ID5 => 0x5A,
 	XZ_ID6 => 0x00,
+	ZST_ID1 => 0x28,
+	ZST_ID2 => 0xB5,
+	ZST_ID3 => 0x2F,
+	ZST_ID4 => 0xFD,
 
 	# compression methods
 	# 0x00-0x07 are reserved
@@ -90,4 +94,9 @@ sub is_xz {
 		$fconstants{XZ_ID5}, $fconstants{XZ_ID6});
 }
 
+sub is_zst {
+	magic(shift, $fconstants{ZST_ID1}, $fconstants{ZST_ID2},
+		$fconstants{ZST_ID3}, $fconstants{ZST_ID4});
+}
+
 1
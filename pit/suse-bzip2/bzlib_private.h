@@ -278,6 +278,9 @@ BZ2_compressBlock ( EState*, Bool );
 extern void 
 BZ2_bsInitWrite ( EState* );
 
+extern Int32 
+BZ2_compressLoneBlock ( EState* );
+
 extern void 
 BZ2_hbAssignCodes ( Int32*, UChar*, Int32, Int32, Int32 );
 
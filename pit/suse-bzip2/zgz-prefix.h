@@ -0,0 +1,47 @@
+/*
+ * Renames the library's symbols, so that this copy of libbz2 can be
+ * linked into zgz next to the other bzip2 implementations there.
+ * Included with -include when building libbz2-zgz.a.
+ */
+
+#ifndef ZGZ_PREFIX_H
+#define ZGZ_PREFIX_H
+
+#define BZ2_blockSort                  suse_BZ2_blockSort
+#define BZ2_bsInitWrite                suse_BZ2_bsInitWrite
+#define BZ2_bzBuffToBuffCompress       suse_BZ2_bzBuffToBuffCompress
+#define BZ2_bzBuffToBuffDecompress     suse_BZ2_bzBuffToBuffDecompress
+#define BZ2_bzCompress                 suse_BZ2_bzCompress
+#define BZ2_bzCompressEnd              suse_BZ2_bzCompressEnd
+#define BZ2_bzCompressInit             suse_BZ2_bzCompressInit
+#define BZ2_bzDecompress               suse_BZ2_bzDecompress
+#define BZ2_bzDecompressEnd            suse_BZ2_bzDecompressEnd
+#define BZ2_bzDecompressInit           suse_BZ2_bzDecompressInit
+#define BZ2_bzRead                     suse_BZ2_bzRead
+#define BZ2_bzReadClose                suse_BZ2_bzReadClose
+#define BZ2_bzReadGetUnused            suse_BZ2_bzReadGetUnused
+#define BZ2_bzReadOpen                 suse_BZ2_bzReadOpen
+#define BZ2_bzWrite                    suse_BZ2_bzWrite
+#define BZ2_bzWriteClose               suse_BZ2_bzWriteClose
+#define BZ2_bzWriteClose64             suse_BZ2_bzWriteClose64
+#define BZ2_bzWriteOpen                suse_BZ2_bzWriteOpen
+#define BZ2_bz__AssertH__fail          suse_BZ2_bz__AssertH__fail
+#define BZ2_bzclose                    suse_BZ2_bzclose
+#define BZ2_bzdopen                    suse_BZ2_bzdopen
+#define BZ2_bzerror                    suse_BZ2_bzerror
+#define BZ2_bzflush                    suse_BZ2_bzflush
+#define BZ2_bzlibVersion               suse_BZ2_bzlibVersion
+#define BZ2_bzopen                     suse_BZ2_bzopen
+#define BZ2_bzread                     suse_BZ2_bzread
+#define BZ2_bzwrite                    suse_BZ2_bzwrite
+#define BZ2_compressBlock              suse_BZ2_compressBlock
+#define BZ2_compressLoneBlock          suse_BZ2_compressLoneBlock
+#define BZ2_crc32Table                 suse_BZ2_crc32Table
+#define BZ2_decompress                 suse_BZ2_decompress
+#define BZ2_hbAssignCodes              suse_BZ2_hbAssignCodes
+#define BZ2_hbCreateDecodeTables       suse_BZ2_hbCreateDecodeTables
+#define BZ2_hbMakeCodeLengths          suse_BZ2_hbMakeCodeLengths
+#define BZ2_indexIntoF                 suse_BZ2_indexIntoF
+#define BZ2_rNums                      suse_BZ2_rNums
+
+#endif
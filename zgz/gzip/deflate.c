@@ -78,6 +78,11 @@
 
 #include "gzip.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define SIMD_MATCH
+#  include <immintrin.h>
+#endif
+
 /* ===========================================================================
  * Configuration parameters
  */
@@ -195,6 +200,14 @@ static unsigned good_match;
 static ulg rsync_sum;  /* rolling sum of rsync window */
 static ulg rsync_chunk_end; /* next rsync sequence point */
 
+static unsigned rsync_scanned;
+/* Window positions below this have been added to rsync_sum. */
+
+static uch rsync_match[2L*WSIZE];
+/* Set for each scanned window position where the window sum matches the
+ * magic value. Moves along with the window.
+ */
+
 /* Values for max_lazy_match, good_match and max_chain_length, depending on
  * the desired pack level (0..9). The values given below have been tuned to
  * exclude worst case performance for pathological files. Better values may be
@@ -242,6 +255,14 @@ static config configuration_table[10] = {
 static void fill_window(void);
 
        int  longest_match(IPos cur_match);
+#ifndef UNALIGNED_OK
+static unsigned match_len_c(uch *scan, uch *match);
+static unsigned (*match_len)(uch *scan, uch *match) = match_len_c;
+#ifdef SIMD_MATCH
+static unsigned match_len_sse2(uch *scan, uch *match);
+static unsigned match_len_avx2(uch *scan, uch *match);
+#endif
+#endif
 
 /* ===========================================================================
  * Update a hash value with the given input byte
@@ -281,6 +302,7 @@ void lm_init (int pack_level, /* 1: best speed, 9: best compression */
     /* rsync params */
     rsync_chunk_end = 0xFFFFFFFFUL;
     rsync_sum = 0;
+    rsync_scanned = 0;
 
     /* Set the default configuration parameters:
      */
@@ -290,6 +312,16 @@ void lm_init (int pack_level, /* 1: best speed, 9: best compression */
     nice_match       = configuration_table[pack_level].nice_length;
 #endif
     max_chain_length = configuration_table[pack_level].max_chain;
+
+#if !defined(UNALIGNED_OK) && defined(SIMD_MATCH)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        match_len = match_len_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        match_len = match_len_sse2;
+    }
+#endif
+
     if (pack_level == 1) {
        *flags |= FAST;
     } else if (pack_level == 9) {
@@ -355,7 +387,6 @@ int longest_match(IPos cur_match)
     register ush scan_start = *(ush*)scan;
     register ush scan_end   = *(ush*)(scan+best_len-1);
 #else
-    register uch *strend = window + strstart + MAX_MATCH;
     register uch scan_end1  = scan[best_len-1];
     register uch scan_end   = scan[best_len];
 #endif
@@ -409,29 +440,13 @@ int longest_match(IPos cur_match)
 
         if (match[best_len]   != scan_end  ||
             match[best_len-1] != scan_end1 ||
-            *match            != *scan     ||
-            *++match          != scan[1])      continue;
+            match[0]          != scan[0]   ||
+            match[1]          != scan[1])      continue;
 
         /* The check at best_len-1 can be removed because it will be made
          * again later. (This heuristic is not always a win.)
-         * It is not necessary to compare scan[2] and match[2] since they
-         * are always equal when the other bytes match, given that
-         * the hash keys are equal and that HASH_BITS >= 8.
          */
-        scan += 2, match++;
-
-        /* We check for insufficient lookahead only every 8th comparison;
-         * the 256th check will be made at strstart+258.
-         */
-        do {
-        } while (*++scan == *++match && *++scan == *++match &&
-                 *++scan == *++match && *++scan == *++match &&
-                 *++scan == *++match && *++scan == *++match &&
-                 *++scan == *++match && *++scan == *++match &&
-                 scan < strend);
-
-        len = MAX_MATCH - (int)(strend - scan);
-        scan = strend - MAX_MATCH;
+        len = (*match_len)(scan, match);
 
 #endif /* UNALIGNED_OK */
 
@@ -452,6 +467,79 @@ int longest_match(IPos cur_match)
     return best_len;
 }
 
+#ifndef UNALIGNED_OK
+/* ===========================================================================
+ * Return the length of the match between the strings at scan and match,
+ * whose first two bytes are already known to be equal, that is, the index
+ * of the first byte in 3..MAX_MATCH-1 where they differ, or MAX_MATCH.
+ * It is not necessary to compare scan[2] and match[2] since they
+ * are always equal when the other bytes match, given that
+ * the hash keys are equal and that HASH_BITS >= 8.
+ * Bytes up to scan[MAX_MATCH] may be read, which is safe since
+ * strstart <= window_size-MIN_LOOKAHEAD.
+ */
+static unsigned match_len_c(uch *scan, uch *match)
+{
+    register uch *strend = scan + MAX_MATCH;
+
+    scan += 2, match += 2;
+
+    /* We check for insufficient lookahead only every 8th comparison;
+     * the 256th check will be made at strstart+258.
+     */
+    do {
+    } while (*++scan == *++match && *++scan == *++match &&
+             *++scan == *++match && *++scan == *++match &&
+             *++scan == *++match && *++scan == *++match &&
+             *++scan == *++match && *++scan == *++match &&
+             scan < strend);
+
+    return MAX_MATCH - (unsigned)(strend - scan);
+}
+
+#ifdef SIMD_MATCH
+/* The vector versions compare the 256 bytes at offsets 3..258, exactly
+ * the bytes the loop above looks at, 16 or 32 at a time. A difference
+ * at offset 258 still gives a MAX_MATCH long match, as above.
+ */
+__attribute__((target("sse2")))
+static unsigned match_len_sse2(uch *scan, uch *match)
+{
+    unsigned n;
+
+    for (n = 3; n < MAX_MATCH; n += 16) {
+        __m128i s = _mm_loadu_si128((__m128i *)(scan + n));
+        __m128i m = _mm_loadu_si128((__m128i *)(match + n));
+        unsigned diff = _mm_movemask_epi8(_mm_cmpeq_epi8(s, m)) ^ 0xffff;
+
+        if (diff) {
+            n += __builtin_ctz(diff);
+            return n < MAX_MATCH ? n : MAX_MATCH;
+        }
+    }
+    return MAX_MATCH;
+}
+
+__attribute__((target("avx2")))
+static unsigned match_len_avx2(uch *scan, uch *match)
+{
+    unsigned n;
+
+    for (n = 3; n < MAX_MATCH; n += 32) {
+        __m256i s = _mm256_loadu_si256((__m256i *)(scan + n));
+        __m256i m = _mm256_loadu_si256((__m256i *)(match + n));
+        unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(s, m));
+
+        if (diff) {
+            n += __builtin_ctz(diff);
+            return n < MAX_MATCH ? n : MAX_MATCH;
+        }
+    }
+    return MAX_MATCH;
+}
+#endif /* SIMD_MATCH */
+#endif /* !UNALIGNED_OK */
+
 /* ===========================================================================
  * Fill the window when the lookahead becomes insufficient.
  * Updates strstart and lookahead, and sets eofile if end of input file.
@@ -485,6 +573,10 @@ static void fill_window(void)
         strstart    -= WSIZE; /* we now have strstart >= MAX_DIST: */
 	if (rsync_chunk_end != 0xFFFFFFFFUL)
 	    rsync_chunk_end -= WSIZE;
+	if (rsync_scanned >= WSIZE) {
+	    memcpy((char*)rsync_match, (char*)rsync_match+WSIZE, (unsigned)WSIZE);
+	    rsync_scanned -= WSIZE;
+	}
 
         block_start -= (long) WSIZE;
 
@@ -512,31 +604,83 @@ static void fill_window(void)
     }
 }
 
-static void rsync_roll(unsigned start, unsigned num)
+/* ===========================================================================
+ * Add window positions rsync_scanned..end-1 to the rolling sum, recording
+ * in rsync_match where it matches the magic value. While the sum does not
+ * yet cover a full window, no matches are looked for.
+ */
+static void rsync_scan(unsigned end)
 {
-    unsigned i;
+    unsigned i = rsync_scanned;
 
-    if (start < RSYNC_WIN) {
-	/* before window fills. */
-	for (i = start; i < RSYNC_WIN; i++) {
-	    if (i == start + num) return;
-	    rsync_sum += (ulg)window[i];
+    for (; i < end && i < (unsigned)RSYNC_WIN; i++) {
+	rsync_sum += (ulg)window[i];
+	rsync_match[i] = 0;
+    }
+
+#ifdef __SSE2__
+    /* Both rsync window sizes are powers of two, so the Debian modulo
+     * test is a mask test too, and only the low 16 bits of the sum
+     * matter. Eight positions at a time, compute the byte differences,
+     * their prefix sums (which fit easily in 16 bits) and test the
+     * resulting window sums.
+     */
+    if ((RSYNC_WIN & (RSYNC_WIN - 1)) == 0) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask = _mm_set1_epi16((short)(RSYNC_WIN - 1));
+	const __m128i one = _mm_set1_epi8(1);
+
+	for (; i + 8 <= end; i += 8) {
+	    __m128i in  = _mm_loadl_epi64((__m128i *)(window + i));
+	    __m128i out = _mm_loadl_epi64((__m128i *)(window + i - RSYNC_WIN));
+	    __m128i d = _mm_sub_epi16(_mm_unpacklo_epi8(in, zero),
+				      _mm_unpacklo_epi8(out, zero));
+	    __m128i sum, hit;
+
+	    d = _mm_add_epi16(d, _mm_slli_si128(d, 2));
+	    d = _mm_add_epi16(d, _mm_slli_si128(d, 4));
+	    d = _mm_add_epi16(d, _mm_slli_si128(d, 8));
+	    sum = _mm_add_epi16(d, _mm_set1_epi16((short)rsync_sum));
+	    hit = _mm_cmpeq_epi16(_mm_and_si128(sum, mask), zero);
+	    _mm_storel_epi64((__m128i *)(rsync_match + i),
+			     _mm_and_si128(_mm_packs_epi16(hit, zero), one));
+	    rsync_sum += (ulg)(long)(short)_mm_extract_epi16(d, 7);
 	}
-	num -= (RSYNC_WIN - start);
-	start = RSYNC_WIN;
     }
+#endif
 
-    /* buffer after window full */
-    for (i = start; i < start+num; i++) {
+    for (; i < end; i++) {
 	/* New character in */
 	rsync_sum += (ulg)window[i];
 	/* Old character out */
 	rsync_sum -= (ulg)window[i - RSYNC_WIN];
-	if (debian_rsyncable && rsync_chunk_end == 0xFFFFFFFFUL && RSYNC_SUM_MATCH_DEBIAN(rsync_sum))
-	    rsync_chunk_end = i;
-	if (! debian_rsyncable && rsync_chunk_end == 0xFFFFFFFFUL && RSYNC_SUM_MATCH(rsync_sum))
-	    rsync_chunk_end = i;
+	if (debian_rsyncable)
+	    rsync_match[i] = RSYNC_SUM_MATCH_DEBIAN(rsync_sum);
+	else
+	    rsync_match[i] = RSYNC_SUM_MATCH(rsync_sum);
     }
+
+    rsync_scanned = end;
+}
+
+/* ===========================================================================
+ * Roll the rsync window over positions start..start+num-1, setting
+ * rsync_chunk_end to the first of them where the window sum matches, if
+ * it is not set already. All the input that is in the window is summed
+ * in one go, so that most calls only need to look at rsync_match.
+ */
+static void rsync_roll(unsigned start, unsigned num)
+{
+    uch *match;
+
+    if (start + num > rsync_scanned) {
+	unsigned end = strstart + lookahead;
+	rsync_scan(end > start + num ? end : start + num);
+    }
+
+    if (rsync_chunk_end == 0xFFFFFFFFUL &&
+	(match = memchr(rsync_match + start, 1, num)) != NULL)
+	rsync_chunk_end = match - rsync_match;
 }
 
 /* ===========================================================================
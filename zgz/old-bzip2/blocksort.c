@@ -60,6 +60,7 @@
 
 
 #include "bzlib_private.h"
+#include "../sais.h"
 
 /*---------------------------------------------*/
 /*--- Fallback O(N log(N)^2) sorting        ---*/
@@ -989,6 +990,46 @@ void mainSort ( UInt32* ptr,
 #undef CLEARMASK
 
 
+/*---------------------------------------------*/
+/*--
+   Sorts a block that mainSort found too repetitive
+   with SA-IS, in linear time, instead of fallbackSort.
+   This is only done for blocks that are not periodic:
+   then no two rotations are equal, and the order is the
+   same whichever algorithm sorts them.  Returns False if
+   the block was left unsorted.
+--*/
+static
+Bool saisSort ( EState* s )
+{
+   UChar* text;
+   Int32  i, ret;
+
+   text = malloc ( s->nblock );
+   if (text == NULL) return False;
+   for (i = 0; i < s->nblock; i++)
+      text[i] = (UChar)(s->block[i] >> 8);
+   ret = sais_rotations ( text, s->ptr, s->nblock );
+   free ( text );
+   if (ret != 0) return False;
+
+#if BZ_DEBUG
+   {
+      /* cross-check against fallbackSort */
+      UInt32* sorted = malloc ( s->nblock * sizeof(UInt32) );
+      AssertD ( sorted != NULL, "saisSort: out of memory" );
+      memcpy ( sorted, s->ptr, s->nblock * sizeof(UInt32) );
+      fallbackSort ( s->arr1, s->arr2, s->ftab, s->nblock, s->verbosity );
+      for (i = 0; i < s->nblock; i++)
+         AssertD ( sorted[i] == s->ptr[i],
+                   "saisSort: differs from fallbackSort" );
+      free ( sorted );
+   }
+#endif
+   return True;
+}
+
+
 /*---------------------------------------------*/
 /* Pre:
       nblock > 0
@@ -1042,9 +1083,10 @@ void blockSort ( EState* s )
                     (float)(nblock==0 ? 1 : nblock) ); 
       if (budget < 0) {
          if (verb >= 2) 
-            VPrintf0 ( "    too repetitive; using fallback"
+            VPrintf0 ( "    too repetitive; using SA-IS or fallback"
                        " sorting algorithm\n" );
-         fallbackSort ( s->arr1, s->arr2, ftab, nblock, verb );
+         if (! saisSort ( s ))
+            fallbackSort ( s->arr1, s->arr2, ftab, nblock, verb );
       }
    }
 
@@ -63,6 +63,7 @@
 #include <errno.h>
 #include <ctype.h>
 #include "bzlib.h"
+#include "../parallel-bzip2.h"
 
 #define ERROR_IF_EOF(i)       { if ((i) == EOF)  ioError(); }
 #define ERROR_IF_NOT_ZERO(i)  { if ((i) != 0)    ioError(); }
@@ -170,9 +171,17 @@ void compressStream ( FILE *stream, FILE *zStream )
    /*notreached*/
 }
 
-void old_bzip2(int level) {
+extern const struct pbz_ops oldBzip2PbzOps;
+
+void old_bzip2(int level, int threads) {
 	workFactor = 30;
 	blockSize100k = level;
 
-	compressStream(stdin, stdout);
+	if (threads > 1) {
+		fflush(stdout);
+		pbz_compress(&oldBzip2PbzOps, level, threads,
+			     fileno(stdin), fileno(stdout));
+	}
+	else
+		compressStream(stdin, stdout);
 }
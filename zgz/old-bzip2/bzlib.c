@@ -74,6 +74,7 @@
 --*/
 
 #include "bzlib_private.h"
+#include "../parallel-bzip2.h"
 
 void bz__AssertH__fail ( int errcode ) {
 	fprintf(stderr, "bzip2 compressor internal error\n");
@@ -463,6 +464,59 @@ int BZ_API(bzCompressEnd)  ( bz_stream *strm )
 }
 
 
+/*---------------------------------------------------*/
+/*--- Glue for zgz's parallel compressor          ---*/
+/*---------------------------------------------------*/
+
+/*---------------------------------------------------*/
+static
+void* pbzInit ( int blockSize100k )
+{
+   bz_stream* strm = calloc ( 1, sizeof(bz_stream) );
+   if (strm == NULL) return NULL;
+   if (bzCompressInit ( strm, blockSize100k, 0, 30 ) != BZ_OK) {
+      free ( strm );
+      return NULL;
+   }
+   return strm->state;
+}
+
+
+/*---------------------------------------------------*/
+static
+const unsigned char* pbzCompress ( void* state,
+                                   const struct pbz_block* b,
+                                   long* nbits )
+{
+   EState* s = state;
+   Int32   i;
+
+   for (i = 0; i < b->nblock; i++)
+      s->block[i] = (UInt16)b->block[i];
+   for (i = 0; i < 256; i++)
+      s->inUse[i] = b->inuse[i];
+   s->nblock   = b->nblock;
+   s->blockCRC = ~b->crc;      /* compressBlock finalises it */
+   *nbits = compressLoneBlock ( s );
+   return s->zbits;
+}
+
+
+/*---------------------------------------------------*/
+static
+void pbzEnd ( void* state )
+{
+   bz_stream* strm = ((EState*)state)->strm;
+   bzCompressEnd ( strm );
+   free ( strm );
+}
+
+
+const struct pbz_ops oldBzip2PbzOps = {
+   pbzInit, pbzCompress, pbzEnd
+};
+
+
 #ifndef BZ_NO_STDIO
 /*---------------------------------------------------*/
 /*--- File I/O stuff                              ---*/
@@ -303,6 +303,9 @@ compressBlock ( EState*, Bool );
 extern void 
 bsInitWrite ( EState* );
 
+extern Int32 
+compressLoneBlock ( EState* );
+
 extern void 
 hbAssignCodes ( Int32*, UChar*, Int32, Int32, Int32 );
 
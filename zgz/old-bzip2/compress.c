@@ -622,6 +622,26 @@ void compressBlock ( EState* s, Bool is_last_block )
 }
 
 
+/*---------------------------------------------------*/
+/*--
+   Compresses a block on its own, for the parallel
+   compressor in zgz: no stream header or trailer, and
+   the bit buffer starts out empty and is flushed at the
+   end.  Returns the number of bits left in s->zbits.
+--*/
+Int32 compressLoneBlock ( EState* s )
+{
+   Int32 nbits;
+
+   s->blockNo = 2;
+   bsInitWrite ( s );
+   compressBlock ( s, False );
+   nbits = s->numZ * 8 + s->bsLive;
+   bsFinishWrite ( s );
+   return nbits;
+}
+
+
 /*-------------------------------------------------------------*/
 /*--- end                                        compress.c ---*/
 /*-------------------------------------------------------------*/
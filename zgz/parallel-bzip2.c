@@ -0,0 +1,484 @@
+/*
+ * Multithreaded bzip2 block compression, producing exactly the same
+ * stream as the serial bzip2 encoder.
+ *
+ * bzip2 blocks are independent apart from the combined CRC in the
+ * stream trailer, and the bit buffer that carries over from one block
+ * to the next. The main thread reads the input, does the initial
+ * run-length encoding and splits it into blocks exactly where the
+ * serial encoder would, and computes each block's CRC. Worker threads
+ * then sort and entropy code the blocks, using whichever bzip2
+ * implementation is plugged in, and the main thread stitches their
+ * bit strings together in order, at whatever bit offset the previous
+ * block ended.
+ *
+ * It can also compress like pbzip2, which splits its input into fixed
+ * size chunks and makes each one a complete bzip2 stream of its own,
+ * concatenating the results.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "parallel-bzip2.h"
+
+#define BUFLEN		(64 * 1024)
+
+struct pbz_job {
+	struct pbz_block blk;
+	unsigned char *bits;		/* compressed block */
+	long nbits;
+	int done;			/* the bits are available */
+	struct pbz_job *next;		/* queue of ready jobs */
+};
+
+static const struct pbz_ops *ops;
+static int level;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+static struct pbz_job *queue, **queue_tail = &queue;
+static int shutting_down;
+static int streams;			/* compressing separate streams */
+
+static unsigned int crc_table[256];
+
+static void
+make_crc_table(void)
+{
+	unsigned int c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = (unsigned int)i << 24;
+		for (j = 0; j < 8; j++)
+			c = (c & 0x80000000) ? (c << 1) ^ 0x04c11db7 : c << 1;
+		crc_table[i] = c;
+	}
+}
+
+/*
+ * The initial run-length encoding. This must split the input into
+ * blocks exactly as bzlib's ADD_CHAR_TO_BLOCK and add_pair_to_block
+ * do: a block is full once it holds nblockMAX symbols, and a run that
+ * is still pending at that point goes into the next block.
+ */
+struct rle_state {
+	unsigned int ch;		/* 256 if no run pending */
+	int len;
+};
+
+static void
+add_pair(struct pbz_block *b, struct rle_state *r)
+{
+	unsigned char ch = (unsigned char)r->ch;
+	int i;
+
+	for (i = 0; i < r->len; i++)
+		b->crc = (b->crc << 8) ^ crc_table[(b->crc >> 24) ^ ch];
+	b->inuse[ch] = 1;
+	for (i = 0; i < r->len && i < 4; i++)
+		b->block[b->nblock++] = ch;
+	if (r->len >= 4) {
+		b->inuse[r->len - 4] = 1;
+		b->block[b->nblock++] = (unsigned char)(r->len - 4);
+	}
+}
+
+/* adds input to a block; returns how much was used, stopping early
+ * if the block is full */
+static size_t
+fill_block(struct pbz_block *b, struct rle_state *r, int nblockmax,
+	   const unsigned char *buf, size_t len)
+{
+	size_t i;
+	unsigned int c;
+
+	for (i = 0; i < len; i++) {
+		if (b->nblock >= nblockmax)
+			break;
+		c = buf[i];
+		if (c != r->ch && r->len == 1) {
+			unsigned char ch = (unsigned char)r->ch;
+			b->crc = (b->crc << 8) ^ crc_table[(b->crc >> 24) ^ ch];
+			b->inuse[ch] = 1;
+			b->block[b->nblock++] = ch;
+			r->ch = c;
+		} else if (c != r->ch || r->len == 255) {
+			if (r->ch < 256)
+				add_pair(b, r);
+			r->ch = c;
+			r->len = 1;
+		} else {
+			r->len++;
+		}
+	}
+	return i;
+}
+
+static void *
+worker(void *arg)
+{
+	void *state;
+	struct pbz_job *job;
+	const unsigned char *bits;
+	long nbits;
+
+	state = streams ? NULL : ops->init(level);
+	if (state == NULL && ! streams)
+		errx(1, "bzip2 compressor initialisation failed");
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while (queue == NULL && ! shutting_down)
+			pthread_cond_wait(&work, &lock);
+		if (queue == NULL) {
+			pthread_mutex_unlock(&lock);
+			break;
+		}
+		job = queue;
+		queue = job->next;
+		if (queue == NULL)
+			queue_tail = &queue;
+		pthread_mutex_unlock(&lock);
+
+		if (streams) {
+			/* bzip2's worst case expansion */
+			unsigned int len = job->blk.nblock +
+				job->blk.nblock / 100 + 600;
+
+			job->bits = malloc(len);
+			if (job->bits == NULL)
+				errx(1, "malloc failed");
+			if (ops->stream(job->bits, &len, job->blk.block,
+					job->blk.nblock, level) != 0)
+				errx(1, "bzip2 compression failed");
+			nbits = (long)len * 8;
+		} else {
+			bits = ops->compress(state, &job->blk, &nbits);
+			job->bits = malloc(nbits / 8 + 1);
+			if (job->bits == NULL)
+				errx(1, "malloc failed");
+			memcpy(job->bits, bits, (nbits + 7) / 8);
+		}
+
+		pthread_mutex_lock(&lock);
+		job->nbits = nbits;
+		job->done = 1;
+		pthread_cond_broadcast(&finished);
+		pthread_mutex_unlock(&lock);
+	}
+
+	if (state != NULL)
+		ops->end(state);
+	return NULL;
+}
+
+/* bit-level output, as bzlib's bsW */
+struct bitout {
+	int fd;
+	unsigned int buff;
+	int live;
+	unsigned char buf[BUFLEN];
+	size_t len;
+};
+
+static void
+write_all(int fd, const unsigned char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = write(fd, buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			err(1, "write");
+		done += n;
+	}
+}
+
+static void
+out_flush(struct bitout *o)
+{
+	write_all(o->fd, o->buf, o->len);
+	o->len = 0;
+}
+
+static void
+out_bits(struct bitout *o, int n, unsigned int v)
+{
+	while (o->live >= 8) {
+		if (o->len == BUFLEN)
+			out_flush(o);
+		o->buf[o->len++] = (unsigned char)(o->buff >> 24);
+		o->buff <<= 8;
+		o->live -= 8;
+	}
+	o->buff |= v << (32 - o->live - n);
+	o->live += n;
+}
+
+static void
+out_uint32(struct bitout *o, unsigned int u)
+{
+	out_bits(o, 8, (u >> 24) & 0xff);
+	out_bits(o, 8, (u >> 16) & 0xff);
+	out_bits(o, 8, (u >> 8) & 0xff);
+	out_bits(o, 8, u & 0xff);
+}
+
+static void
+out_block(struct bitout *o, const unsigned char *bits, long nbits)
+{
+	long i;
+
+	for (i = 0; i < nbits / 8; i++)
+		out_bits(o, 8, bits[i]);
+	if (nbits % 8)
+		out_bits(o, nbits % 8, bits[i] >> (8 - nbits % 8));
+}
+
+static void
+out_finish(struct bitout *o)
+{
+	while (o->live > 0) {
+		if (o->len == BUFLEN)
+			out_flush(o);
+		o->buf[o->len++] = (unsigned char)(o->buff >> 24);
+		o->buff <<= 8;
+		o->live -= 8;
+	}
+	out_flush(o);
+}
+
+void
+pbz_compress(const struct pbz_ops *o, int blocksize100k, int threads,
+	     int in, int out)
+{
+	pthread_t *tids;
+	struct pbz_job *jobs;
+	struct rle_state rle = { 256, 0 };
+	struct bitout bo = { .fd = out };
+	unsigned char *inbuf;
+	size_t inlen = 0, inpos = 0;
+	unsigned int combined = 0;
+	int nblockmax = 100000 * blocksize100k - 19;
+	int njobs = 2 * threads;
+	int head = 0, tail = 0, eof = 0;
+	struct pbz_job *job;
+	int i;
+	ssize_t n;
+
+	ops = o;
+	level = blocksize100k;
+	make_crc_table();
+
+	inbuf = malloc(BUFLEN);
+	jobs = calloc(njobs, sizeof(*jobs));
+	tids = calloc(threads, sizeof(*tids));
+	if (inbuf == NULL || jobs == NULL || tids == NULL)
+		errx(1, "malloc failed");
+	for (i = 0; i < njobs; i++) {
+		jobs[i].blk.block = malloc(nblockmax + 20);
+		if (jobs[i].blk.block == NULL)
+			errx(1, "malloc failed");
+	}
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&tids[i], NULL, worker, NULL) != 0)
+			errx(1, "pthread_create failed");
+
+	out_bits(&bo, 8, 'B');
+	out_bits(&bo, 8, 'Z');
+	out_bits(&bo, 8, 'h');
+	out_bits(&bo, 8, '0' + blocksize100k);
+
+	/* jobs[tail..head) are in flight, in stream order */
+	while (! eof || head != tail) {
+		while (! eof && head - tail < njobs) {
+			struct pbz_block *b;
+
+			job = &jobs[head % njobs];
+			b = &job->blk;
+
+			b->nblock = 0;
+			b->crc = 0xffffffff;
+			memset(b->inuse, 0, sizeof(b->inuse));
+			job->done = 0;
+			job->next = NULL;
+
+			while (b->nblock < nblockmax) {
+				if (inpos == inlen) {
+					n = read(in, inbuf, BUFLEN);
+					if (n < 0 && errno == EINTR)
+						continue;
+					if (n < 0)
+						err(1, "read");
+					if (n == 0) {
+						eof = 1;
+						if (rle.ch < 256)
+							add_pair(b, &rle);
+						break;
+					}
+					inlen = n;
+					inpos = 0;
+				}
+				inpos += fill_block(b, &rle, nblockmax,
+						    inbuf + inpos, inlen - inpos);
+			}
+			b->crc = ~b->crc;
+
+			if (b->nblock == 0)
+				break;
+			pthread_mutex_lock(&lock);
+			*queue_tail = job;
+			queue_tail = &job->next;
+			pthread_cond_signal(&work);
+			pthread_mutex_unlock(&lock);
+			head++;
+		}
+
+		if (head == tail)
+			break;
+
+		/* write out the oldest block once it is done */
+		pthread_mutex_lock(&lock);
+		while (! jobs[tail % njobs].done)
+			pthread_cond_wait(&finished, &lock);
+		pthread_mutex_unlock(&lock);
+
+		job = &jobs[tail % njobs];
+		combined = (combined << 1) | (combined >> 31);
+		combined ^= job->blk.crc;
+		out_block(&bo, job->bits, job->nbits);
+		free(job->bits);
+		job->bits = NULL;
+		tail++;
+	}
+
+	pthread_mutex_lock(&lock);
+	shutting_down = 1;
+	pthread_cond_broadcast(&work);
+	pthread_mutex_unlock(&lock);
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+
+	out_bits(&bo, 8, 0x17);
+	out_bits(&bo, 8, 0x72);
+	out_bits(&bo, 8, 0x45);
+	out_bits(&bo, 8, 0x38);
+	out_bits(&bo, 8, 0x50);
+	out_bits(&bo, 8, 0x90);
+	out_uint32(&bo, combined);
+	out_finish(&bo);
+
+	for (i = 0; i < njobs; i++)
+		free(jobs[i].blk.block);
+	free(jobs);
+	free(tids);
+	free(inbuf);
+}
+
+/*
+ * Compresses like pbzip2: each chunk of the input is compressed on its
+ * own into a complete bzip2 stream, and the streams are concatenated.
+ * Empty input still gets one (empty) stream.
+ */
+void
+pbz_streams(const struct pbz_ops *o, int blocksize100k, size_t chunk,
+	    int threads, int in, int out)
+{
+	pthread_t *tids;
+	struct pbz_job *jobs, *job;
+	int njobs = 2 * threads;
+	int head = 0, tail = 0, eof = 0;
+	int i;
+	ssize_t n;
+
+	ops = o;
+	level = blocksize100k;
+	streams = 1;
+
+	jobs = calloc(njobs, sizeof(*jobs));
+	tids = calloc(threads, sizeof(*tids));
+	if (jobs == NULL || tids == NULL)
+		errx(1, "malloc failed");
+	for (i = 0; i < njobs; i++) {
+		jobs[i].blk.block = malloc(chunk);
+		if (jobs[i].blk.block == NULL)
+			errx(1, "malloc failed");
+	}
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&tids[i], NULL, worker, NULL) != 0)
+			errx(1, "pthread_create failed");
+
+	while (! eof || head != tail) {
+		while (! eof && head - tail < njobs) {
+			job = &jobs[head % njobs];
+			job->blk.nblock = 0;
+			job->done = 0;
+			job->next = NULL;
+
+			while ((size_t)job->blk.nblock < chunk) {
+				n = read(in, job->blk.block + job->blk.nblock,
+					 chunk - job->blk.nblock);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n < 0)
+					err(1, "read");
+				if (n == 0) {
+					eof = 1;
+					break;
+				}
+				job->blk.nblock += n;
+			}
+
+			if (job->blk.nblock == 0 && head > 0)
+				break;
+			pthread_mutex_lock(&lock);
+			*queue_tail = job;
+			queue_tail = &job->next;
+			pthread_cond_signal(&work);
+			pthread_mutex_unlock(&lock);
+			head++;
+		}
+
+		if (head == tail)
+			break;
+
+		pthread_mutex_lock(&lock);
+		while (! jobs[tail % njobs].done)
+			pthread_cond_wait(&finished, &lock);
+		pthread_mutex_unlock(&lock);
+
+		job = &jobs[tail % njobs];
+		write_all(out, job->bits, job->nbits / 8);
+		free(job->bits);
+		job->bits = NULL;
+		tail++;
+	}
+
+	pthread_mutex_lock(&lock);
+	shutting_down = 1;
+	pthread_cond_broadcast(&work);
+	pthread_mutex_unlock(&lock);
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+
+	for (i = 0; i < njobs; i++)
+		free(jobs[i].blk.block);
+	free(jobs);
+	free(tids);
+}
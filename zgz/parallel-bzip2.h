@@ -0,0 +1,39 @@
+/*
+ * Interface between the multithreaded bzip2 block compressor and the
+ * bzip2 implementations that do the actual work.
+ */
+
+#ifndef PARALLEL_BZIP2_H
+#define PARALLEL_BZIP2_H
+
+/* a block after the initial run-length encoding */
+struct pbz_block {
+	unsigned char *block;
+	int nblock;			/* or the chunk size, for streams */
+	unsigned int crc;		/* finalised block CRC */
+	unsigned char inuse[256];
+};
+
+struct pbz_ops {
+	/* sets up compressor state for one thread */
+	void *(*init)(int blocksize100k);
+	/* sorts and codes a block, without stream header or trailer,
+	 * starting at a byte boundary; returns the bits, which are
+	 * valid until the next call with the same state */
+	const unsigned char *(*compress)(void *state, const struct pbz_block *,
+					 long *nbits);
+	void (*end)(void *state);
+	/* compresses a buffer into a complete stream, as
+	 * bzBuffToBuffCompress with the default work factor;
+	 * returns 0 on success */
+	int (*stream)(unsigned char *dest, unsigned int *destlen,
+		      unsigned char *src, unsigned int srclen,
+		      int blocksize100k);
+};
+
+extern void pbz_compress(const struct pbz_ops *, int blocksize100k,
+			 int threads, int in, int out);
+extern void pbz_streams(const struct pbz_ops *, int blocksize100k,
+			size_t chunk, int threads, int in, int out);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * Linear time sorting of the rotations of a bzip2 block, by building
+ * the suffix array of the doubled block with SA-IS (Nong, Zhang and
+ * Chan, "Two Efficient Algorithms for Linear Time Suffix Array
+ * Construction", 2009).
+ *
+ * bzip2 sorts rotations, not suffixes. If a block is not periodic, no
+ * two of its rotations are equal, so the suffixes of the block
+ * concatenated with itself that start in its first half come out in
+ * exactly the order of the rotations, and that order is the only
+ * correct one: any sorter, including bzip2's own, has to produce the
+ * same ptr[] and origPtr. Periodic blocks have equal rotations, whose
+ * relative order is an accident of the sorting algorithm, so those
+ * are left to bzip2's sorters.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sais.h"
+
+/* the text is unsigned shorts at the top level, and ints when recursing */
+#define chr(i)	(cs == sizeof(int) ? ((const int *)s)[i] : \
+		 ((const unsigned short *)s)[i])
+#define tget(i)	((t[(i) / 8] >> ((i) % 8)) & 1)
+#define tset(i, b) \
+	(t[(i) / 8] = (b) ? (t[(i) / 8] | (1 << ((i) % 8))) \
+			  : (t[(i) / 8] & ~(1 << ((i) % 8))))
+#define is_lms(i) ((i) > 0 && tget(i) && ! tget((i) - 1))
+
+static void
+get_buckets(const void *s, int *bkt, int n, int k, int cs, int end)
+{
+	int i, sum = 0;
+
+	for (i = 0; i <= k; i++)
+		bkt[i] = 0;
+	for (i = 0; i < n; i++)
+		bkt[chr(i)]++;
+	for (i = 0; i <= k; i++) {
+		sum += bkt[i];
+		bkt[i] = end ? sum : sum - bkt[i];
+	}
+}
+
+static void
+induce_l(const unsigned char *t, int *sa, const void *s, int *bkt,
+	 int n, int k, int cs)
+{
+	int i, j;
+
+	get_buckets(s, bkt, n, k, cs, 0);
+	for (i = 0; i < n; i++) {
+		j = sa[i] - 1;
+		if (j >= 0 && ! tget(j))
+			sa[bkt[chr(j)]++] = j;
+	}
+}
+
+static void
+induce_s(const unsigned char *t, int *sa, const void *s, int *bkt,
+	 int n, int k, int cs)
+{
+	int i, j;
+
+	get_buckets(s, bkt, n, k, cs, 1);
+	for (i = n - 1; i >= 0; i--) {
+		j = sa[i] - 1;
+		if (j >= 0 && tget(j))
+			sa[--bkt[chr(j)]] = j;
+	}
+}
+
+/* builds the suffix array of s[0..n-1], whose last character must be
+ * a unique smallest sentinel 0, over the alphabet 0..k */
+static int
+sais(const void *s, int *sa, int n, int k, int cs)
+{
+	unsigned char *t;
+	int *bkt, *s1;
+	int i, j, n1, name, prev, pos, d, diff;
+
+	t = calloc(n / 8 + 1, 1);
+	bkt = malloc(sizeof(int) * (k + 1));
+	if (t == NULL || bkt == NULL) {
+		free(t);
+		free(bkt);
+		return -1;
+	}
+
+	/* classify the suffixes as S or L type */
+	tset(n - 2, 0);
+	tset(n - 1, 1);
+	for (i = n - 3; i >= 0; i--)
+		tset(i, chr(i) < chr(i + 1) ||
+			(chr(i) == chr(i + 1) && tget(i + 1)));
+
+	/* sort the LMS substrings */
+	get_buckets(s, bkt, n, k, cs, 1);
+	for (i = 0; i < n; i++)
+		sa[i] = -1;
+	for (i = 1; i < n; i++)
+		if (is_lms(i))
+			sa[--bkt[chr(i)]] = i;
+	induce_l(t, sa, s, bkt, n, k, cs);
+	induce_s(t, sa, s, bkt, n, k, cs);
+
+	/* name them, and compact the names into a reduced string */
+	n1 = 0;
+	for (i = 0; i < n; i++)
+		if (is_lms(sa[i]))
+			sa[n1++] = sa[i];
+	for (i = n1; i < n; i++)
+		sa[i] = -1;
+	name = 0;
+	prev = -1;
+	for (i = 0; i < n1; i++) {
+		pos = sa[i];
+		diff = 0;
+		for (d = 0; d < n; d++) {
+			if (prev == -1 || chr(pos + d) != chr(prev + d) ||
+			    tget(pos + d) != tget(prev + d)) {
+				diff = 1;
+				break;
+			}
+			if (d > 0 && (is_lms(pos + d) || is_lms(prev + d)))
+				break;
+		}
+		if (diff) {
+			name++;
+			prev = pos;
+		}
+		sa[n1 + pos / 2] = name - 1;
+	}
+	for (i = n - 1, j = n - 1; i >= n1; i--)
+		if (sa[i] >= 0)
+			sa[j--] = sa[i];
+
+	/* sort the reduced string, recursively if the names aren't
+	 * unique yet */
+	s1 = sa + n - n1;
+	if (name < n1) {
+		if (sais(s1, sa, n1, name - 1, sizeof(int)) != 0) {
+			free(t);
+			free(bkt);
+			return -1;
+		}
+	} else {
+		for (i = 0; i < n1; i++)
+			sa[s1[i]] = i;
+	}
+
+	/* induce the full order from the sorted LMS suffixes */
+	get_buckets(s, bkt, n, k, cs, 1);
+	for (i = 1, j = 0; i < n; i++)
+		if (is_lms(i))
+			s1[j++] = i;
+	for (i = 0; i < n1; i++)
+		sa[i] = s1[sa[i]];
+	for (i = n1; i < n; i++)
+		sa[i] = -1;
+	for (i = n1 - 1; i >= 0; i--) {
+		j = sa[i];
+		sa[i] = -1;
+		sa[--bkt[chr(j)]] = j;
+	}
+	induce_l(t, sa, s, bkt, n, k, cs);
+	induce_s(t, sa, s, bkt, n, k, cs);
+
+	free(t);
+	free(bkt);
+	return 0;
+}
+
+/* checks whether the block is a repetition of a shorter string, using
+ * the KMP failure function; fail must have room for nblock + 1 ints */
+static int
+periodic(const unsigned char *block, int *fail, int nblock)
+{
+	int i, k = -1;
+
+	fail[0] = -1;
+	for (i = 0; i < nblock; i++) {
+		while (k >= 0 && block[k] != block[i])
+			k = fail[k];
+		fail[i + 1] = ++k;
+	}
+	k = nblock - fail[nblock];
+	return k < nblock && nblock % k == 0;
+}
+
+/*
+ * Sorts the rotations of a block, storing their starting positions in
+ * ptr[0..nblock-1], as bzip2's blockSort does. Returns 0 on success,
+ * or -1 if the block is periodic or memory is short, in which case
+ * ptr is left alone.
+ */
+int
+sais_rotations(const unsigned char *block, unsigned int *ptr, int nblock)
+{
+	unsigned short *text;
+	int *sa;
+	int i, j, n = 2 * nblock + 1;
+
+	sa = malloc(sizeof(int) * n);
+	if (sa == NULL)
+		return -1;
+	if (periodic(block, sa, nblock)) {
+		free(sa);
+		return -1;
+	}
+
+	text = malloc(sizeof(unsigned short) * n);
+	if (text == NULL) {
+		free(sa);
+		return -1;
+	}
+	for (i = 0; i < nblock; i++)
+		text[i] = text[i + nblock] = block[i] + 1;
+	text[n - 1] = 0;
+
+	if (sais(text, sa, n, 256, sizeof(unsigned short)) != 0) {
+		free(text);
+		free(sa);
+		return -1;
+	}
+
+	for (i = 0, j = 0; i < n; i++)
+		if (sa[i] < nblock)
+			ptr[j++] = sa[i];
+
+	free(text);
+	free(sa);
+	return 0;
+}
@@ -0,0 +1,11 @@
+/*
+ * Linear time sorting of the rotations of a bzip2 block.
+ */
+
+#ifndef SAIS_H
+#define SAIS_H
+
+extern int sais_rotations(const unsigned char *block, unsigned int *ptr,
+			  int nblock);
+
+#endif
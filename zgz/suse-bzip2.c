@@ -0,0 +1,155 @@
+/*
+ * In-process suse bzip2 (1.0.6) compression, using the copy of its
+ * libbz2 in pit/suse-bzip2 that is built with renamed symbols, so it
+ * can be linked next to old-bzip2.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "../pit/suse-bzip2/zgz-prefix.h"
+#include "../pit/suse-bzip2/bzlib_private.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include "parallel-bzip2.h"
+
+#define BUFLEN		(64 * 1024)
+
+/*
+ * Compresses stdin to stdout the same way as running the suse bzip2
+ * program: it uses bzWrite with the default work factor of 30, which
+ * amounts to BZ_RUN followed by BZ_FINISH.
+ */
+static void
+suse_bzip2_serial(int level)
+{
+	bz_stream strm;
+	char *inbuf, *outbuf;
+	ssize_t n, w, done;
+	int action = BZ_RUN, ret;
+
+	inbuf = malloc(BUFLEN);
+	outbuf = malloc(BUFLEN);
+	if (inbuf == NULL || outbuf == NULL)
+		errx(1, "malloc failed");
+
+	strm.bzalloc = NULL;
+	strm.bzfree = NULL;
+	strm.opaque = NULL;
+	if (BZ2_bzCompressInit(&strm, level, 0, 30) != BZ_OK)
+		errx(1, "bzip2 compressor initialisation failed");
+
+	strm.avail_in = 0;
+	do {
+		if (strm.avail_in == 0 && action == BZ_RUN) {
+			n = read(STDIN_FILENO, inbuf, BUFLEN);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				err(1, "read");
+			if (n == 0)
+				action = BZ_FINISH;
+			strm.next_in = inbuf;
+			strm.avail_in = n;
+		}
+
+		strm.next_out = outbuf;
+		strm.avail_out = BUFLEN;
+		ret = BZ2_bzCompress(&strm, action);
+		if (ret != BZ_RUN_OK && ret != BZ_FINISH_OK &&
+		    ret != BZ_STREAM_END)
+			errx(1, "bzip2 compression failed (%d)", ret);
+
+		for (done = 0; done < BUFLEN - strm.avail_out; done += w) {
+			w = write(STDOUT_FILENO, outbuf + done,
+				  BUFLEN - strm.avail_out - done);
+			if (w < 0 && errno == EINTR)
+				w = 0;
+			else if (w <= 0)
+				err(1, "write");
+		}
+	} while (ret != BZ_STREAM_END);
+
+	BZ2_bzCompressEnd(&strm);
+	free(inbuf);
+	free(outbuf);
+}
+
+/* glue for the parallel compressor */
+static void *
+pbz_init(int level)
+{
+	bz_stream *strm = calloc(1, sizeof(bz_stream));
+
+	if (strm == NULL)
+		return NULL;
+	if (BZ2_bzCompressInit(strm, level, 0, 30) != BZ_OK) {
+		free(strm);
+		return NULL;
+	}
+	return strm->state;
+}
+
+static const unsigned char *
+pbz_block(void *state, const struct pbz_block *b, long *nbits)
+{
+	EState *s = state;
+	int i;
+
+	memcpy(s->block, b->block, b->nblock);
+	for (i = 0; i < 256; i++)
+		s->inUse[i] = b->inuse[i];
+	s->nblock = b->nblock;
+	s->blockCRC = ~b->crc;		/* compressBlock finalises it */
+	*nbits = BZ2_compressLoneBlock(s);
+	return s->zbits;
+}
+
+static void
+pbz_end(void *state)
+{
+	bz_stream *strm = ((EState *)state)->strm;
+
+	BZ2_bzCompressEnd(strm);
+	free(strm);
+}
+
+static int
+pbz_stream(unsigned char *dest, unsigned int *destlen, unsigned char *src,
+	   unsigned int srclen, int level)
+{
+	return BZ2_bzBuffToBuffCompress((char *)dest, destlen, (char *)src,
+					srclen, level, 0, 30) == BZ_OK ? 0 : -1;
+}
+
+static const struct pbz_ops suse_ops = {
+	pbz_init, pbz_block, pbz_end, pbz_stream
+};
+
+void
+suse_bzip2(int level, int threads)
+{
+	if (threads > 1)
+		pbz_compress(&suse_ops, level, threads,
+			     STDIN_FILENO, STDOUT_FILENO);
+	else
+		suse_bzip2_serial(level);
+}
+
+/*
+ * Compresses stdin to stdout the same way as pbzip2 does when it is
+ * linked with this libbz2: the input is split into chunks of
+ * chunk100k * 100000 bytes (pbzip2's -b), and each one is compressed
+ * into a stream of its own with bzBuffToBuffCompress.
+ */
+void
+suse_pbzip2(int level, int chunk100k, int threads)
+{
+	pbz_streams(&suse_ops, level, (size_t)chunk100k * 100000,
+		    threads > 0 ? threads : 1, STDIN_FILENO, STDOUT_FILENO);
+}
@@ -0,0 +1,187 @@
+/*
+ * xz compression using liblzma, the same way the xz program compresses
+ * a file in its (default) single-threaded mode, or with -T.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <lzma.h>
+
+#define BUFLEN		(64 * 1024)
+
+/* returns the check for an xz --check=NAME, or -1 if it is unknown */
+int
+xz_check(const char *name)
+{
+	if (strcmp(name, "none") == 0)
+		return LZMA_CHECK_NONE;
+	if (strcmp(name, "crc32") == 0)
+		return LZMA_CHECK_CRC32;
+	if (strcmp(name, "crc64") == 0)
+		return LZMA_CHECK_CRC64;
+	if (strcmp(name, "sha256") == 0)
+		return LZMA_CHECK_SHA256;
+	return -1;
+}
+
+/* the size suffixes xz accepts */
+static const struct {
+	const char *name;
+	uint64_t multiplier;
+} suffixes[] = {
+	{ "k", 1 << 10 }, { "kB", 1 << 10 }, { "Ki", 1 << 10 }, { "KiB", 1 << 10 },
+	{ "M", 1 << 20 }, { "MB", 1 << 20 }, { "Mi", 1 << 20 }, { "MiB", 1 << 20 },
+	{ "G", 1 << 30 }, { "GB", 1 << 30 }, { "Gi", 1 << 30 }, { "GiB", 1 << 30 },
+};
+
+/*
+ * Parses the next size from an xz --block-list, the way xz does: a size
+ * can have a suffix such as KiB or MiB, 0 means the rest of the input,
+ * and once the list runs out its last size is repeated.
+ */
+static uint64_t
+next_block(const char **list, uint64_t last)
+{
+	uint64_t size;
+	size_t len, i;
+	char *end;
+
+	if (*list == NULL || **list == '\0')
+		return last;
+	if (**list < '0' || **list > '9')
+		errx(1, "bad block list");
+	size = strtoull(*list, &end, 10);
+	len = strcspn(end, ",");
+	if (len > 0) {
+		for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+			if (strlen(suffixes[i].name) == len &&
+			    strncmp(end, suffixes[i].name, len) == 0)
+				break;
+		if (i == sizeof(suffixes) / sizeof(suffixes[0]) ||
+		    size > UINT64_MAX / suffixes[i].multiplier)
+			errx(1, "bad block list");
+		size *= suffixes[i].multiplier;
+	}
+	end += len;
+	*list = *end == ',' ? end + 1 : end;
+	if (size == 0 && **list != '\0')
+		errx(1, "0 can only be the last size in a block list");
+	return size;
+}
+
+static void
+write_full(const uint8_t *buf, size_t len)
+{
+	ssize_t w;
+
+	while (len > 0) {
+		w = write(STDOUT_FILENO, buf, len);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			err(1, "write");
+		buf += w;
+		len -= w;
+	}
+}
+
+/*
+ * Compresses stdin to stdout like xz -z -<preset>[e] --check=<check>.
+ * If a block list is given, a new block is started after each of its
+ * sizes, which is what xz --block-list does by flushing the encoder.
+ *
+ * If mtblock is not 0, the multithreaded encoder is used, as xz -T
+ * does, with blocks of up to mtblock bytes. Its output records the
+ * size of each block in the block's header, and does not depend on
+ * the number of threads, so any number can be used to reproduce it.
+ */
+void
+xz_compress(int preset, int extreme, int check, const char *blocklist,
+	    uint64_t mtblock, int threads)
+{
+	lzma_mt mt;
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_options_lzma opt;
+	lzma_filter filters[2];
+	lzma_action action = LZMA_RUN, flush = LZMA_FULL_FLUSH;
+	lzma_ret ret;
+	uint8_t *inbuf, *outbuf;
+	uint64_t size, left;
+	size_t want;
+	ssize_t n;
+
+	if (lzma_lzma_preset(&opt, preset | (extreme ? LZMA_PRESET_EXTREME : 0)))
+		errx(1, "unsupported xz preset %d", preset);
+	filters[0].id = LZMA_FILTER_LZMA2;
+	filters[0].options = &opt;
+	filters[1].id = LZMA_VLI_UNKNOWN;
+	filters[1].options = NULL;
+	if (mtblock > 0) {
+		memset(&mt, 0, sizeof(mt));
+		mt.threads = threads > 0 ? threads : 1;
+		mt.block_size = mtblock;
+		mt.filters = filters;
+		mt.check = check;
+		if (lzma_stream_encoder_mt(&strm, &mt) != LZMA_OK)
+			errx(1, "xz compressor initialisation failed");
+		/* lets the other blocks carry on */
+		flush = LZMA_FULL_BARRIER;
+	} else if (lzma_stream_encoder(&strm, filters, check) != LZMA_OK) {
+		errx(1, "xz compressor initialisation failed");
+	}
+
+	inbuf = malloc(BUFLEN);
+	outbuf = malloc(BUFLEN);
+	if (inbuf == NULL || outbuf == NULL)
+		errx(1, "malloc failed");
+
+	left = size = next_block(&blocklist, 0);
+	strm.next_out = outbuf;
+	strm.avail_out = BUFLEN;
+	for (;;) {
+		if (strm.avail_in == 0 && action == LZMA_RUN) {
+			want = BUFLEN;
+			if (left > 0 && left < want)
+				want = left;
+			n = read(STDIN_FILENO, inbuf, want);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				err(1, "read");
+			if (n == 0)
+				action = LZMA_FINISH;
+			else if (left > 0 && (left -= n) == 0)
+				action = flush;
+			strm.next_in = inbuf;
+			strm.avail_in = n;
+		}
+
+		ret = lzma_code(&strm, action);
+		if (strm.avail_out == 0 || ret == LZMA_STREAM_END) {
+			write_full(outbuf, BUFLEN - strm.avail_out);
+			strm.next_out = outbuf;
+			strm.avail_out = BUFLEN;
+		}
+		if (ret == LZMA_STREAM_END) {
+			if (action == LZMA_FINISH)
+				break;
+			/* the block is flushed; on to the next one */
+			action = LZMA_RUN;
+			left = size = next_block(&blocklist, size);
+		} else if (ret != LZMA_OK) {
+			errx(1, "xz compression failed (%d)", ret);
+		}
+	}
+
+	lzma_end(&strm);
+	free(inbuf);
+	free(outbuf);
+}
@@ -58,6 +58,7 @@
 #include <sys/time.h>
 
 #include <inttypes.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -70,9 +71,15 @@
 #include <stdarg.h>
 #include <getopt.h>
 #include <time.h>
+#include <pthread.h>
 
 extern void gnuzip(int in, int out, char *origname, unsigned long timestamp, int level, int osflag, int rsync, int newrsync);
-extern void old_bzip2(int level);
+extern void old_bzip2(int level, int threads);
+extern void suse_bzip2(int level, int threads);
+extern void suse_pbzip2(int level, int chunk100k, int threads);
+extern int xz_check(const char *name);
+extern void xz_compress(int preset, int extreme, int check, const char *blocklist, uint64_t mtblock, int threads);
+extern void zstd_compress(int level, int checksum, uint64_t contentsize, int window, int mt, int threads);
 
 #define BUFLEN		(64 * 1024)
 
@@ -122,17 +129,21 @@ static	const char	gzip_copyright[] = \
 " * SUCH DAMAGE.";
 
 static	int	qflag;			/* quiet mode */
+static	int	verify_fd = -1;		/* file to compare output with */
+static	int	verify_out = -1;	/* real stdout when verifying */
+static	pthread_t verify_thread;
 
 static	void	maybe_err(const char *fmt, ...)
     __attribute__((__format__(__printf__, 1, 2),noreturn));
 static	void	maybe_errx(const char *fmt, ...)
     __attribute__((__format__(__printf__, 1, 2),noreturn));
+static	long long	parse_number(const char *, const char *);
 static	void	gz_compress(int, int, const char *, uint32_t, int, int, int, int, int);
 static	void	usage(void);
 static	void	display_version(void);
 static	void	display_license(void);
-static	void	shamble(char *, int);
-static	void    rebrain(char *, char *, int);
+static	void	verify_start(const char *);
+static	void	verify_finish(void);
 
 int main(int, char **p);
 
@@ -154,6 +165,8 @@ static const struct option longopts[] = {
 	{ "old-bzip2",          no_argument,            0,      'O' },
 	{ "suse-bzip2",         no_argument,            0,      'S' },
 	{ "suse-pbzip2",        no_argument,            0,      'P' },
+	{ "xz",                 no_argument,            0,      'X' },
+	{ "zstd",               no_argument,            0,      'Y' },
 	{ "zlib",               no_argument,            0,      'Z' },
 	{ "rsyncable",          no_argument,            0,      'R' },
 	{ "new-rsyncable",      no_argument,            0,      'r' },
@@ -164,6 +177,18 @@ static const struct option longopts[] = {
 	{ "original-name",	required_argument,	0,	'o' },
 	{ "filename",		required_argument,	0,	'F' },
 	{ "quirk",		required_argument,	0,	'k' },
+	{ "verify",		required_argument,	0,	'C' },
+	{ "threads",		required_argument,	0,	'j' },
+	{ "block-size",		required_argument,	0,	'b' },
+	{ "extreme",		no_argument,		0,	'e' },
+	{ "check",		required_argument,	0,	'K' },
+	{ "block-list",		required_argument,	0,	'B' },
+	{ "xz-block-size",	required_argument,	0,	'U' },
+	{ "level",		required_argument,	0,	'l' },
+	{ "zstd-no-check",	no_argument,		0,	'H' },
+	{ "zstd-content-size",	required_argument,	0,	'E' },
+	{ "zstd-long",		required_argument,	0,	'W' },
+	{ "zstd-mt",		no_argument,		0,	'J' },
 	/* end */
 	{ "version",		no_argument,		0,	'V' },
 	{ "license",		no_argument,		0,	'L' },
@@ -178,8 +203,20 @@ main(int argc, char **argv)
 	int bzold = 0;
 	int bzsuse = 0;
 	int pbzsuse = 0;
+	int xz = 0;
+	int extreme = 0;
+	int check = -1;
+	char *blocklist = NULL;
+	uint64_t mtblock = 0;
+	int zstd = 0;
+	int zstdcheck = 1;
+	uint64_t contentsize = 0;
+	int window = 0;
+	int zstdmt = 0;
+	long long n;
 	int quirks = 0;
 	char *origname = NULL;
+	char *verify = NULL;
 	uint32_t timestamp = 0;
 	int memlevel = 8; /* zlib's default */
 	int nflag = 0;
@@ -191,6 +228,8 @@ main(int argc, char **argv)
 	int osflag = GZIP_OS_UNIX;
 	int rsync = 0;
 	int new_rsync = 0;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int chunk100k = 9;
 	int ch;
 
 	if (strcmp(progname, "gunzip") == 0 ||
@@ -200,7 +239,7 @@ main(int argc, char **argv)
 		usage();
 	}
 
-#define OPT_LIST "123456789acdfhF:GLNnMmqRrT:Vo:k:s:ZOSP"
+#define OPT_LIST "0123456789ab:B:cC:dE:efhF:GHJK:l:LNnMmqRrT:U:Vo:k:s:j:W:XYZOSP"
 
 	while ((ch = getopt_long(argc, argv, OPT_LIST, longopts, NULL)) != -1) {
 		switch (ch) {
@@ -216,8 +255,56 @@ main(int argc, char **argv)
 		case 'P':
 			pbzsuse = 1;
 			break;
+		case 'X':
+			xz = 1;
+			break;
+		case 'Y':
+			zstd = 1;
+			break;
 		case 'Z':
 			break;
+		case 'e':
+			extreme = 1;
+			break;
+		case 'K':
+			check = xz_check(optarg);
+			if (check == -1)
+				maybe_errx("unknown check: %s", optarg);
+			break;
+		case 'B':
+			blocklist = optarg;
+			break;
+		case 'U':
+			n = parse_number(optarg, "xz block size");
+			if (n < 1)
+				maybe_errx("xz block size must be at least 1");
+			mtblock = n;
+			break;
+		case 'l':
+			n = parse_number(optarg, "level");
+			if (n < 0 || n > 22)
+				maybe_errx("level must be from 0 to 22");
+			level = n;
+			break;
+		case 'H':
+			zstdcheck = 0;
+			break;
+		case 'E':
+			n = parse_number(optarg, "content size");
+			if (n < 0)
+				maybe_errx("content size must not be negative");
+			contentsize = n;
+			break;
+		case 'W':
+			n = parse_number(optarg, "window log");
+			if (n < 10 || n > 31)
+				maybe_errx("window log must be from 10 to 31");
+			window = n;
+			break;
+		case 'J':
+			zstdmt = 1;
+			break;
+		case '0':
 		case '1': case '2': case '3':
 		case '4': case '5': case '6':
 		case '7': case '8': case '9':
@@ -226,6 +313,9 @@ main(int argc, char **argv)
 		case 'c':
 			/* Ignored for compatibility; zgz always uses -c */
 			break;
+		case 'C':
+			verify = optarg;
+			break;
 		case 'f':
 			fflag = 1;
 			break;
@@ -288,6 +378,20 @@ main(int argc, char **argv)
 		case 'T':
 			timestamp = atoi(optarg);
 			break;
+		case 'j':
+			n = parse_number(optarg, "threads");
+			if (n < 1)
+				maybe_errx("threads must be at least 1");
+			if (n > INT_MAX)
+				maybe_errx("too many threads: %s", optarg);
+			threads = n;
+			break;
+		case 'b':
+			/* pbzip2 -b, which unlike the level can be over 9 */
+			chunk100k = parse_number(optarg, "block size");
+			if (chunk100k < 1 || chunk100k > 100)
+				maybe_errx("block size must be from 1 to 100");
+			break;
 		case 'R':
 			rsync = 1;
 			break;
@@ -320,9 +424,18 @@ main(int argc, char **argv)
 		return 1;
 	}
 
-	if (fflag == 0 && isatty(STDOUT_FILENO))
+	if (verify)
+		verify_start(verify);
+	else if (fflag == 0 && isatty(STDOUT_FILENO))
 		maybe_errx("standard output is a terminal -- ignoring");
 
+	if (level == 0 && ! xz)
+		maybe_errx("level 0 is only supported with --xz");
+	if (level > 9 && ! zstd)
+		maybe_errx("levels over 9 are only supported with --zstd");
+	if (zstd && level == 0)
+		maybe_errx("zstd levels start at 1");
+
 	if (nflag)
 		origname = NULL;
 	if (mflag)
@@ -339,11 +452,31 @@ main(int argc, char **argv)
 			fprintf(stderr, "%s: quirks not supported with --old-bzip2\n", progname);
 			return 1;
 		}
-		old_bzip2(level);
+		old_bzip2(level, threads);
 	} else if (bzsuse) {
-		shamble("suse-bzip2/bzip2", level);
+		if (quirks) {
+			fprintf(stderr, "%s: quirks not supported with --suse-bzip2\n", progname);
+			return 1;
+		}
+		suse_bzip2(level, threads);
 	} else if (pbzsuse) {
-		rebrain("suse-bzip2", "pbzip2", level);
+		if (quirks) {
+			fprintf(stderr, "%s: quirks not supported with --suse-pbzip2\n", progname);
+			return 1;
+		}
+		suse_pbzip2(level, chunk100k, threads);
+	} else if (xz) {
+		if (quirks) {
+			fprintf(stderr, "%s: quirks not supported with --xz\n", progname);
+			return 1;
+		}
+		xz_compress(level, extreme, check == -1 ? xz_check("crc64") : check, blocklist, mtblock, threads);
+	} else if (zstd) {
+		if (quirks) {
+			fprintf(stderr, "%s: quirks not supported with --zstd\n", progname);
+			return 1;
+		}
+		zstd_compress(level, zstdcheck, contentsize, window, zstdmt, threads);
 	} else {
 		if (rsync || new_rsync) {
 			fprintf(stderr, "%s: --rsyncable not supported with --zlib\n", progname);
@@ -352,6 +485,8 @@ main(int argc, char **argv)
 
 		gz_compress(STDIN_FILENO, STDOUT_FILENO, origname, timestamp, level, memlevel, osflag, xflag, ntfs_quirk);
 	}
+	if (verify)
+		verify_finish();
 	return 0;
 }
 
@@ -369,6 +504,20 @@ maybe_err(const char *fmt, ...)
 	exit(1);
 }
 
+/* parses a whole decimal number given for an option */
+static long long
+parse_number(const char *arg, const char *what)
+{
+	char *end;
+	long long n;
+
+	errno = 0;
+	n = strtoll(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0')
+		maybe_errx("bad %s: %s", what, arg);
+	return n;
+}
+
 /* ... without an errno. */
 void
 maybe_errx(const char *fmt, ...)
@@ -514,62 +663,111 @@ gz_compress(int in, int out, const char *origname, uint32_t mtime, int level, in
 	free(outbufp);
 }
 
-/* runs an external, reanimated compressor program */
-static	void
-shamble(char *zombie, int level)
+/* reads until the buffer is full or EOF */
+static ssize_t
+read_full(int fd, char *buf, size_t len)
 {
-	char *exec_buf;
-	char level_buf[3];
-	char *argv[3];
-	int i, len;
-
-	len = strlen(PKGLIBDIR) + 1 + strlen(zombie) + 1;
-	exec_buf = malloc(len);
-	snprintf(exec_buf, len, "%s/%s", PKGLIBDIR, zombie);
-	snprintf(level_buf, sizeof(level_buf), "-%i", level);
-
-	i = 0;
-	argv[i++] = exec_buf;
-	argv[i++] = level_buf;
-	argv[i++] = NULL;
-
-	execvp(exec_buf, argv);
-	perror("Failed to run external program");
-	exit(1);
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(fd, buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return n;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
 }
 
-/* swaps in a different library and runs a system program */
-static	void
-rebrain(char *zombie, char *program, int level)
+/* reports where the output first differs from the file being verified,
+ * and gives up on compressing the rest */
+static void
+verify_differs(off_t offset)
 {
-	char *path_buf;
-	char level_buf[3];
-	char *argv[3];
-	int i, len;
-
-#if defined(__APPLE__) && defined(__MACH__)
-#	define LD_PATH_VAR "DYLD_LIBRARY_PATH" 
-#else
-#	define LD_PATH_VAR "LD_LIBRARY_PATH"
-#endif
-
-	len = strlen(PKGLIBDIR) + 1 + strlen(zombie) + 1;
-	path_buf = malloc(len);
-	snprintf(path_buf, len, "%s/%s", PKGLIBDIR, zombie);
-	/* FIXME - should append, not overwrite */
-	setenv(LD_PATH_VAR, path_buf, 1);
-	free(path_buf);
-
-	snprintf(level_buf, sizeof(level_buf), "-%i", level);
-
-	i = 0;
-	argv[i++] = program;
-	argv[i++] = level_buf;
-	argv[i++] = NULL;
-
-	execvp(program, argv);
-	perror("Failed to run external program");
-	exit(1);
+	char buf[32];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%lld\n", (long long)offset);
+	if (write(verify_out, buf, len) != len)
+		_exit(2);
+	_exit(1);
+}
+
+/* compares everything written to stdout with the file being verified */
+static void *
+verify_compare(void *arg)
+{
+	int in = (int)(intptr_t)arg;
+	char *outbuf, *filebuf;
+	off_t offset = 0;
+	ssize_t n, m, i;
+
+	outbuf = malloc(BUFLEN);
+	filebuf = malloc(BUFLEN);
+	if (outbuf == NULL || filebuf == NULL)
+		maybe_err("malloc failed");
+
+	for (;;) {
+		n = read(in, outbuf, BUFLEN);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			maybe_err("read");
+		if (n == 0) {
+			/* the output ended; so must the file */
+			if (read_full(verify_fd, filebuf, 1) != 0)
+				verify_differs(offset);
+			break;
+		}
+
+		m = read_full(verify_fd, filebuf, n);
+		if (m < 0)
+			maybe_err("read");
+		if (m != n || memcmp(outbuf, filebuf, n) != 0) {
+			for (i = 0; i < m && outbuf[i] == filebuf[i]; i++)
+				;
+			verify_differs(offset + i);
+		}
+		offset += n;
+	}
+
+	free(outbuf);
+	free(filebuf);
+	return NULL;
+}
+
+/* sets up stdout to be compared with a file, rather than written */
+static void
+verify_start(const char *file)
+{
+	int fds[2];
+
+	verify_fd = open(file, O_RDONLY);
+	if (verify_fd == -1)
+		maybe_err("%s", file);
+	verify_out = dup(STDOUT_FILENO);
+	if (verify_out == -1 || pipe(fds) == -1 ||
+	    dup2(fds[1], STDOUT_FILENO) == -1)
+		maybe_err("pipe");
+	close(fds[1]);
+
+	if (pthread_create(&verify_thread, NULL, verify_compare,
+			   (void *)(intptr_t)fds[0]) != 0)
+		maybe_errx("pthread_create failed");
+}
+
+/* waits for the comparison to finish; only returns if the output
+ * matched */
+static void
+verify_finish(void)
+{
+	fflush(stdout);
+	close(STDOUT_FILENO);
+	pthread_join(verify_thread, NULL);
 }
 
 /* display usage */
@@ -585,9 +783,13 @@ usage(void)
     " -O --old-bzip2           generate bzip2 (0.9.5d) output\n"
     " -S --suse-bzip2          generate suse bzip2 output\n"
     " -P --suse-pbzip2         generate suse pbzip2 output\n"
+    " -X --xz                  generate xz output\n"
+    " -Y --zstd                generate zstd output\n"
     " -1 --fast                fastest (worst) compression\n"
     " -2 .. -8                 set compression level\n"
     " -9 --best                best (slowest) compression\n"
+    " -l --level N             set compression level, which can be up to 22\n"
+    "                          with --zstd\n"
     " -f --force               force writing compressed data to a terminal\n"
     " -N --name                save or restore original file name and time stamp\n"
     " -n --no-name             don't save original file name or time stamp\n"
@@ -601,6 +803,32 @@ usage(void)
     " -F NAME --filename NAME  same as --original-name\n"
     " -s --osflag              set the OS flag to something different than 03 (Unix)\n"
     " -T --timestamp SECONDS   set the timestamp to the specified number of seconds\n"
+    " -C --verify FILE         compare the output with FILE instead of writing it;\n"
+    "                          if they differ, print the offset and exit 1\n"
+    " -j --threads N           use up to N threads (default: number of CPUs)\n"
+    " \nsuse-pbzip2-specific options:\n"
+    " -b --block-size N        compress N*100k byte chunks separately, N from 1\n"
+    "                          to 100 (default: 9)\n"
+    " \nxz-specific options:\n"
+    " -0                       lowest compression preset\n"
+    " -e --extreme             use the extreme variant of the preset\n"
+    " -K --check NAME          integrity check (none, crc32, crc64, sha256)\n"
+    " -B --block-list SIZES    start a new block after each of the\n"
+    "                          comma separated uncompressed SIZES, as xz\n"
+    "                          does; the last size repeats, and 0 means\n"
+    "                          the rest of the input\n"
+    " -U --xz-block-size SIZE  use xz's multithreaded format, with blocks of\n"
+    "                          up to SIZE bytes compressed in parallel\n"
+    " \nzstd-specific options:\n"
+    " -H --zstd-no-check       do not store a checksum, as zstd --no-check\n"
+    " -E --zstd-content-size SIZE\n"
+    "                          record SIZE, which must be the size of the\n"
+    "                          input, in the header, as zstd --stream-size\n"
+    " -W --zstd-long WLOG      use long distance matching with a window of\n"
+    "                          2^WLOG bytes, as zstd --long\n"
+    " -J --zstd-mt             use zstd's multithreaded format, which it\n"
+    "                          makes by default, rather than that of\n"
+    "                          zstd --single-thread\n"
     " \ngnu-specific options:\n"
     " -R --rsyncable           make rsync-friendly archive\n"
     " -r --new-rsyncable       make rsync-friendly archive (new version)\n"
@@ -0,0 +1,114 @@
+/*
+ * zstd compression using libzstd, the same way the zstd program
+ * compresses its standard input.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <zstd.h>
+
+static void
+write_full(const uint8_t *buf, size_t len)
+{
+	ssize_t w;
+
+	while (len > 0) {
+		w = write(STDOUT_FILENO, buf, len);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			err(1, "write");
+		buf += w;
+		len -= w;
+	}
+}
+
+static void
+set_param(ZSTD_CCtx *cctx, ZSTD_cParameter param, int value,
+	  const char *what)
+{
+	if (ZSTD_isError(ZSTD_CCtx_setParameter(cctx, param, value)))
+		errx(1, "unsupported zstd %s %d", what, value);
+}
+
+/*
+ * Compresses stdin to stdout like zstd -<level> -c. Without checksum,
+ * it is zstd --no-check. If contentsize is not 0, it is recorded in the
+ * frame header, as zstd --stream-size does, and must be the size of the
+ * input. If window is not 0, it is the window log of zstd --long.
+ *
+ * If mt is set, the multithreaded format that zstd makes by default, or
+ * with -T, is produced; otherwise, that of zstd --single-thread. The
+ * multithreaded output does not depend on the number of threads, so
+ * any number can be used to reproduce it.
+ */
+void
+zstd_compress(int level, int checksum, uint64_t contentsize, int window,
+	      int mt, int threads)
+{
+	ZSTD_CCtx *cctx;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	ZSTD_EndDirective mode;
+	size_t inlen, outlen, ret;
+	uint8_t *inbuf, *outbuf;
+	ssize_t n;
+
+	cctx = ZSTD_createCCtx();
+	if (cctx == NULL)
+		errx(1, "zstd compressor initialisation failed");
+	set_param(cctx, ZSTD_c_compressionLevel, level, "level");
+	set_param(cctx, ZSTD_c_checksumFlag, checksum, "checksum flag");
+	if (window > 0) {
+		set_param(cctx, ZSTD_c_enableLongDistanceMatching, 1,
+			  "long distance matching");
+		set_param(cctx, ZSTD_c_windowLog, window, "window log");
+	}
+	if (mt)
+		set_param(cctx, ZSTD_c_nbWorkers, threads > 0 ? threads : 1,
+			  "threads");
+	if (contentsize > 0 &&
+	    ZSTD_isError(ZSTD_CCtx_setPledgedSrcSize(cctx, contentsize)))
+		errx(1, "zstd compressor initialisation failed");
+
+	inlen = ZSTD_CStreamInSize();
+	outlen = ZSTD_CStreamOutSize();
+	inbuf = malloc(inlen);
+	outbuf = malloc(outlen);
+	if (inbuf == NULL || outbuf == NULL)
+		errx(1, "malloc failed");
+
+	do {
+		n = read(STDIN_FILENO, inbuf, inlen);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			err(1, "read");
+		mode = n == 0 ? ZSTD_e_end : ZSTD_e_continue;
+		in.src = inbuf;
+		in.size = n;
+		in.pos = 0;
+		do {
+			out.dst = outbuf;
+			out.size = outlen;
+			out.pos = 0;
+			ret = ZSTD_compressStream2(cctx, &out, &in, mode);
+			if (ZSTD_isError(ret))
+				errx(1, "zstd compression failed: %s",
+				     ZSTD_getErrorName(ret));
+			write_full(outbuf, out.pos);
+		} while (mode == ZSTD_e_end ? ret != 0 : in.pos < in.size);
+	} while (n != 0);
+
+	ZSTD_freeCCtx(cctx);
+	free(inbuf);
+	free(outbuf);
+}